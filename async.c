@@ -0,0 +1,186 @@
+
+#include "async.h"
+#include "fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Requests wait in a FIFO queue until a worker takes them. Workers call
+// the thread-safe fs_read/fs_write, so requests on different inodes run in
+// parallel and ones on the same inode are ordered by the inode lock.
+
+struct fs_aio {
+	int write;
+	int inumber;
+	char *data;
+	int length;
+	int64_t offset;
+	fs_aio_callback done;
+	void *arg;
+	int complete;
+	int result;
+	struct fs_aio *next;
+};
+
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t completed = PTHREAD_COND_INITIALIZER;
+static struct fs_aio *head = NULL;
+static struct fs_aio *tail = NULL;
+static _Bool stopping = 0;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t *workers = NULL;
+static int nworkers = 0;
+
+static void *worker( void *arg )
+{
+	struct fs_aio *req;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&queueLock);
+		while(!head && !stopping)
+			pthread_cond_wait(&queued, &queueLock);
+		req = head;
+		if(req)
+		{
+			head = req->next;
+			if(!head)
+				tail = NULL;
+		}
+		pthread_mutex_unlock(&queueLock);
+		if(!req)
+			return NULL;
+
+		if(req->write)
+			req->result = fs_write(req->inumber, req->data, req->length, req->offset);
+		else
+			req->result = fs_read(req->inumber, req->data, req->length, req->offset);
+		if(req->done)
+			req->done(req->arg, req->result);
+
+		pthread_mutex_lock(&queueLock);
+		req->complete = 1;
+		pthread_cond_broadcast(&completed);
+		pthread_mutex_unlock(&queueLock);
+	}
+}
+
+// Start nthreads workers. Returns 1 on success or if already running.
+int fs_async_start( int nthreads )
+{
+	int i;
+
+	pthread_mutex_lock(&poolLock);
+	if(nworkers > 0)
+	{
+		pthread_mutex_unlock(&poolLock);
+		return 1;
+	}
+	if(nthreads < 1)
+		nthreads = 1;
+	workers = malloc(nthreads * sizeof(pthread_t));
+	for(i = 0; workers && i < nthreads; i++)
+	{
+		if(pthread_create(&workers[i], NULL, worker, NULL) != 0)
+			break;
+	}
+	nworkers = i;
+	pthread_mutex_unlock(&poolLock);
+
+	if(nworkers == 0)
+	{
+		printf("Async Error: Couldn't start any worker threads\n");
+		return 0;
+	}
+	return 1;
+}
+
+// Finish every queued request, then stop the workers.
+void fs_async_stop()
+{
+	int i;
+
+	pthread_mutex_lock(&poolLock);
+	pthread_mutex_lock(&queueLock);
+	stopping = 1;
+	pthread_cond_broadcast(&queued);
+	pthread_mutex_unlock(&queueLock);
+
+	for(i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+	stopping = 0;
+	pthread_mutex_unlock(&poolLock);
+}
+
+static struct fs_aio *submit( int write, int inumber, char *data, int length, int64_t offset, fs_aio_callback done, void *arg )
+{
+	struct fs_aio *req;
+
+	if(!fs_async_start(ASYNC_DEFAULT_THREADS))
+		return NULL;
+
+	req = malloc(sizeof(struct fs_aio));
+	if(!req)
+		return NULL;
+	req->write = write;
+	req->inumber = inumber;
+	req->data = data;
+	req->length = length;
+	req->offset = offset;
+	req->done = done;
+	req->arg = arg;
+	req->complete = 0;
+	req->result = 0;
+	req->next = NULL;
+
+	pthread_mutex_lock(&queueLock);
+	if(tail)
+		tail->next = req;
+	else
+		head = req;
+	tail = req;
+	pthread_cond_signal(&queued);
+	pthread_mutex_unlock(&queueLock);
+	return req;
+}
+
+struct fs_aio *fs_read_async( int inumber, char *data, int length, int64_t offset, fs_aio_callback done, void *arg )
+{
+	return submit(0, inumber, data, length, offset, done, arg);
+}
+
+// The buffer must stay unchanged until the request completes.
+struct fs_aio *fs_write_async( int inumber, const char *data, int length, int64_t offset, fs_aio_callback done, void *arg )
+{
+	return submit(1, inumber, (char *)data, length, offset, done, arg);
+}
+
+// Returns 1 if the request has completed, without waiting.
+int fs_aio_poll( struct fs_aio *req )
+{
+	int complete;
+	pthread_mutex_lock(&queueLock);
+	complete = req->complete;
+	pthread_mutex_unlock(&queueLock);
+	return complete;
+}
+
+// Wait for the request to complete, release the handle and return the
+// result of the fs_read or fs_write.
+int fs_aio_wait( struct fs_aio *req )
+{
+	int result;
+	pthread_mutex_lock(&queueLock);
+	while(!req->complete)
+		pthread_cond_wait(&completed, &queueLock);
+	result = req->result;
+	pthread_mutex_unlock(&queueLock);
+	free(req);
+	return result;
+}
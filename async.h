@@ -0,0 +1,26 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdint.h>
+
+#define ASYNC_DEFAULT_THREADS 4
+
+// Asynchronous fs_read/fs_write, run by a pool of worker threads.
+// Each call returns a handle at once; the optional callback runs on a
+// worker when the request completes, with the fs_read/fs_write result.
+// Every handle must be passed to fs_aio_wait exactly once.
+
+typedef void (*fs_aio_callback)( void *arg, int result );
+
+struct fs_aio;
+
+int  fs_async_start( int nthreads );
+void fs_async_stop();
+
+struct fs_aio *fs_read_async( int inumber, char *data, int length, int64_t offset, fs_aio_callback done, void *arg );
+struct fs_aio *fs_write_async( int inumber, const char *data, int length, int64_t offset, fs_aio_callback done, void *arg );
+
+int  fs_aio_poll( struct fs_aio *req );
+int  fs_aio_wait( struct fs_aio *req );
+
+#endif
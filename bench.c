@@ -0,0 +1,512 @@
+
+#include "fs.h"
+#include "async.h"
+#include "disk.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// Runs a fixed set of workloads against a scratch image and writes one JSON
+// record per workload: throughput, per-op latency percentiles and disk
+// block transfers per logical op. Progress and any fs messages go to stdout.
+
+#define BENCH_SEED 12345
+#define BENCH_MAX_FILE (16*1024*1024)
+#define BENCH_MAX_RANDOM_OPS 4096
+#define BENCH_CHURN_OPS 2000
+#define BENCH_CHURN_FILES 64
+#define BENCH_CHURN_SIZE 8192
+#define BENCH_FILL_CHUNK (1024*1024)
+#define BENCH_QUEUE_DEPTH 32
+#define BENCH_ASYNC_FILES 8
+
+static const int seqSizes[] = { 512, 4096, 65536, 1048576 };
+static const int randomSizes[] = { 4096, 65536 };
+
+struct run {
+	const char *name;
+	int iosize;
+	int files;
+	int ops;
+	int maxops;
+	int64_t bytes;
+	double start;
+	double seconds;
+	double *latency;
+	int reads;
+	int writes;
+};
+
+static FILE *out;
+static int records = 0;
+static int cacheblocks = CACHE_DEFAULT_BLOCKS;
+static int asyncthreads = ASYNC_DEFAULT_THREADS;
+static int formatflags = 0;
+static int compress = 0;
+static int mounted = 0;
+static char *buffer;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int compare_double( const void *a, const void *b )
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile( struct run *r, double p )
+{
+	if(r->ops == 0)
+		return 0;
+	return r->latency[(int)(p * (r->ops - 1))] * 1e6;
+}
+
+static void run_begin( struct run *r, const char *name, int iosize, int maxops )
+{
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->iosize = iosize;
+	r->maxops = maxops;
+	r->latency = malloc(maxops * sizeof(double));
+	r->reads = disk_nreads();
+	r->writes = disk_nwrites();
+	r->start = now();
+}
+
+static void run_op( struct run *r, double opstart, int64_t bytes )
+{
+	if(r->ops < r->maxops)
+		r->latency[r->ops++] = now() - opstart;
+	r->bytes += bytes;
+}
+
+// Dirty blocks still in the cache are written back before the clock stops,
+// so write workloads are charged for the disk writes they cause.
+static void run_end( struct run *r )
+{
+	double ops;
+
+	cache_flush();
+	r->seconds = now() - r->start;
+	r->reads = disk_nreads() - r->reads;
+	r->writes = disk_nwrites() - r->writes;
+	qsort(r->latency, r->ops, sizeof(double), compare_double);
+	ops = r->ops ? r->ops : 1;
+
+	fprintf(out, "%s\n    {\"name\": \"%s\", \"io_size\": %d, ", records ? "," : "", r->name, r->iosize);
+	if(r->files)
+		fprintf(out, "\"files\": %d, ", r->files);
+	fprintf(out, "\"ops\": %d, \"bytes\": %lld, \"seconds\": %.6f, ", r->ops, (long long)r->bytes, r->seconds);
+	fprintf(out, "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, ", r->ops / r->seconds, r->bytes / r->seconds / (1024*1024));
+	fprintf(out, "\"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}, ",
+		percentile(r, 0.50), percentile(r, 0.90), percentile(r, 0.99), percentile(r, 1.0));
+	fprintf(out, "\"disk_reads\": %d, \"disk_writes\": %d, ", r->reads, r->writes);
+	fprintf(out, "\"disk_reads_per_op\": %.3f, \"disk_writes_per_op\": %.3f}", r->reads / ops, r->writes / ops);
+	fflush(out);
+	records++;
+
+	printf("%-12s %8d bytes %7d ops %9.2f MB/s  p50 %8.2f us  p99 %8.2f us\n",
+		r->name, r->iosize, r->ops, r->bytes / r->seconds / (1024*1024), percentile(r, 0.50), percentile(r, 0.99));
+	free(r->latency);
+}
+
+// Create a file, compressed if asked for.
+static int new_file()
+{
+	int inumber = fs_create();
+	if(compress && inumber > 0)
+		fs_set_compression(inumber, 1);
+	return inumber;
+}
+
+static int fresh_fs()
+{
+	if(mounted)
+		fs_unmount();
+	mounted = fs_format(formatflags) && fs_mount();
+	return mounted;
+}
+
+// Remount with an empty cache so the next workload starts cold.
+static int remount()
+{
+	fs_unmount();
+	cache_close();
+	if(!cache_init(cacheblocks))
+		return 0;
+	mounted = fs_mount();
+	return mounted;
+}
+
+static void sequential( int iosize, int64_t filesize )
+{
+	struct run r;
+	int64_t offset;
+	int inumber, n, maxops = filesize / iosize;
+	double t;
+
+	if(!fresh_fs())
+		return;
+	inumber = new_file();
+
+	run_begin(&r, "seq_write", iosize, maxops);
+	for(offset = 0; offset + iosize <= filesize; offset += iosize) {
+		t = now();
+		n = fs_write(inumber, buffer, iosize, offset);
+		if(n <= 0) break;
+		run_op(&r, t, n);
+	}
+	run_end(&r);
+
+	if(!remount())
+		return;
+	run_begin(&r, "seq_read", iosize, maxops);
+	for(offset = 0; offset + iosize <= filesize; offset += iosize) {
+		t = now();
+		n = fs_read(inumber, buffer, iosize, offset);
+		if(n <= 0) break;
+		run_op(&r, t, n);
+	}
+	run_end(&r);
+}
+
+static void random_io( int iosize, int64_t filesize )
+{
+	struct run r;
+	int64_t offset, slots = filesize / iosize;
+	int inumber, i, n, ops = slots < BENCH_MAX_RANDOM_OPS ? slots : BENCH_MAX_RANDOM_OPS;
+	double t;
+
+	if(!fresh_fs())
+		return;
+	inumber = new_file();
+	for(offset = 0; offset < filesize; offset += BENCH_FILL_CHUNK)
+		fs_write(inumber, buffer, BENCH_FILL_CHUNK, offset);
+	if(!remount())
+		return;
+
+	srand(BENCH_SEED);
+	run_begin(&r, "rand_write", iosize, ops);
+	for(i = 0; i < ops; i++) {
+		offset = (rand() % slots) * iosize;
+		t = now();
+		n = fs_write(inumber, buffer, iosize, offset);
+		if(n <= 0) break;
+		run_op(&r, t, n);
+	}
+	run_end(&r);
+
+	if(!remount())
+		return;
+	run_begin(&r, "rand_read", iosize, ops);
+	for(i = 0; i < ops; i++) {
+		offset = (rand() % slots) * iosize;
+		t = now();
+		n = fs_read(inumber, buffer, iosize, offset);
+		if(n <= 0) break;
+		run_op(&r, t, n);
+	}
+	run_end(&r);
+}
+
+// Random I/O through the async API over BENCH_ASYNC_FILES files sharing
+// filesize, with up to BENCH_QUEUE_DEPTH requests in flight on asyncthreads
+// workers. Requests on different files run in parallel, so comparing -a 1
+// with more workers shows what the pool buys. Latency runs from submission
+// to completion.
+static void async_io( int iosize, int64_t filesize )
+{
+	struct run r;
+	struct fs_aio *req[BENCH_QUEUE_DEPTH];
+	double submitted[BENCH_QUEUE_DEPTH];
+	int files[BENCH_ASYNC_FILES];
+	int64_t offset, filebytes = filesize / BENCH_ASYNC_FILES, slots = filebytes / iosize;
+	int i, k, n, f, write, ops = BENCH_MAX_RANDOM_OPS;
+	char *bufs;
+
+	if(slots == 0 || !fresh_fs())
+		return;
+	for(f = 0; f < BENCH_ASYNC_FILES; f++) {
+		files[f] = new_file();
+		if(files[f] == 0)
+			return;
+		for(offset = 0; offset < filebytes; offset += n) {
+			n = filebytes - offset < BENCH_FILL_CHUNK ? filebytes - offset : BENCH_FILL_CHUNK;
+			fs_write(files[f], buffer, n, offset);
+		}
+	}
+	if(ops > slots * BENCH_ASYNC_FILES)
+		ops = slots * BENCH_ASYNC_FILES;
+	if(!remount())
+		return;
+
+	bufs = malloc((size_t)BENCH_QUEUE_DEPTH * iosize);
+	if(!bufs || !fs_async_start(asyncthreads)) {
+		free(bufs);
+		return;
+	}
+	for(i = 0; i < BENCH_QUEUE_DEPTH; i++)
+		memcpy(&bufs[(size_t)i * iosize], buffer, iosize);
+
+	for(write = 1; write >= 0; write--) {
+		srand(BENCH_SEED);
+		run_begin(&r, write ? "async_write" : "async_read", iosize, ops);
+		for(i = 0; i < ops + BENCH_QUEUE_DEPTH; i++) {
+			k = i % BENCH_QUEUE_DEPTH;
+			if(i >= BENCH_QUEUE_DEPTH && req[k]) {
+				n = fs_aio_wait(req[k]);
+				if(n > 0) run_op(&r, submitted[k], n);
+			}
+			if(i >= ops)
+				continue;
+			f = rand() % BENCH_ASYNC_FILES;
+			offset = (rand() % slots) * iosize;
+			submitted[k] = now();
+			if(write)
+				req[k] = fs_write_async(files[f], &bufs[(size_t)k * iosize], iosize, offset, NULL, NULL);
+			else
+				req[k] = fs_read_async(files[f], &bufs[(size_t)k * iosize], iosize, offset, NULL, NULL);
+		}
+		run_end(&r);
+		if(write && !remount())
+			break;
+	}
+	fs_async_stop();
+	free(bufs);
+}
+
+// Create, write and delete small files, keeping a window of them alive.
+static void churn()
+{
+	struct run r;
+	int live[BENCH_CHURN_FILES];
+	int i, slot;
+	double t;
+
+	if(!fresh_fs())
+		return;
+	for(i = 0; i < BENCH_CHURN_FILES; i++)
+		live[i] = -1;
+
+	run_begin(&r, "churn", BENCH_CHURN_SIZE, BENCH_CHURN_OPS);
+	for(i = 0; i < BENCH_CHURN_OPS; i++) {
+		slot = i % BENCH_CHURN_FILES;
+		t = now();
+		if(live[slot] >= 0)
+			fs_delete(live[slot]);
+		live[slot] = new_file();
+		if(live[slot] == 0) break;
+		fs_write(live[slot], buffer, BENCH_CHURN_SIZE, 0);
+		run_op(&r, t, BENCH_CHURN_SIZE);
+	}
+	run_end(&r);
+}
+
+// Make up to nfiles one-block files and return how many were made.
+static int make_files( int nfiles )
+{
+	int i;
+	for(i = 0; i < nfiles; i++) {
+		int inumber = new_file();
+		if(inumber == 0 || fs_write(inumber, buffer, DISK_BLOCK_SIZE, 0) <= 0) break;
+	}
+	return i;
+}
+
+// Time a cold mount of a filesystem holding nfiles one-block files. For an
+// unclean mount a child process makes the files and exits without
+// unmounting, so the mount has to recover: replay the journal, or without
+// one scan the inode table.
+static void mount_time( int nfiles, int clean )
+{
+	struct run r;
+	int files = 0;
+	int fd[2];
+	double t;
+
+	if(!fresh_fs())
+		return;
+	if(clean) {
+		files = make_files(nfiles);
+		fs_unmount();
+	} else {
+		fs_unmount();
+		if(pipe(fd) < 0)
+			return;
+		if(fork() == 0) {
+			if(fs_mount()) {
+				files = make_files(nfiles);
+				fs_sync();
+				cache_flush();
+			}
+			if(write(fd[1], &files, sizeof(files)) != sizeof(files))
+				_exit(1);
+			_exit(0);
+		}
+		close(fd[1]);
+		if(read(fd[0], &files, sizeof(files)) != sizeof(files))
+			files = 0;
+		close(fd[0]);
+		wait(NULL);
+	}
+	mounted = 0;
+	cache_close();
+	cache_init(cacheblocks);
+
+	run_begin(&r, clean ? "mount" : "mount_unclean", 0, 1);
+	r.files = files;
+	t = now();
+	mounted = fs_mount();
+	run_op(&r, t, 0);
+	run_end(&r);
+}
+
+// Write one file until the disk is full.
+static void fill()
+{
+	struct run r;
+	int64_t offset = 0;
+	int inumber, n, maxops = (int64_t)disk_size() * DISK_BLOCK_SIZE / BENCH_FILL_CHUNK + 1;
+	double t;
+
+	if(!fresh_fs())
+		return;
+	inumber = new_file();
+
+	run_begin(&r, "fill", BENCH_FILL_CHUNK, maxops);
+	for(;;) {
+		t = now();
+		n = fs_write(inumber, buffer, BENCH_FILL_CHUNK, offset);
+		if(n <= 0) break;
+		run_op(&r, t, n);
+		offset += n;
+		if(n < BENCH_FILL_CHUNK) break;
+	}
+	run_end(&r);
+
+	// The disk is full now, and a write that fails must not grow the file
+	if(fs_write(inumber, buffer, BENCH_FILL_CHUNK, offset + BENCH_FILL_CHUNK) == 0 && fs_getsize(inumber) != offset)
+		printf("fill: a failed write changed the size from %lld to %lld\n", (long long)offset, (long long)fs_getsize(inumber));
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *outname = "bench.json";
+	int backend = DISK_BACKEND_PREAD;
+	int64_t filesize;
+	int opt, i, nfiles;
+
+	while((opt=getopt(argc,argv,"a:c:eijmo:z"))!=-1) {
+		switch(opt) {
+		case 'a':
+			asyncthreads = atoi(optarg);
+			break;
+		case 'c':
+			cacheblocks = atoi(optarg);
+			break;
+		case 'e':
+			formatflags |= FS_FORMAT_EXTENTS;
+			break;
+		case 'i':
+			formatflags |= FS_FORMAT_INLINE;
+			break;
+		case 'j':
+			formatflags |= FS_FORMAT_JOURNAL;
+			break;
+		case 'm':
+			backend = DISK_BACKEND_MMAP;
+			break;
+		case 'o':
+			outname = optarg;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-e] [-i] [-j] [-m] [-z] [-a asyncthreads] [-c cacheblocks] [-o output.json] <diskfile> <nblocks>\n",argv[0]);
+		return 1;
+	}
+
+	if(compress && (formatflags & FS_FORMAT_EXTENTS)) {
+		printf("compression is not supported with the extent format\n");
+		return 1;
+	}
+
+	if(cacheblocks <= 0 && (formatflags & FS_FORMAT_JOURNAL)) {
+		printf("the journal needs a cache of at least one block\n");
+		return 1;
+	}
+
+	if(!disk_init(argv[optind],atoi(argv[optind+1]),backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+
+	if(!cache_init(cacheblocks)) {
+		printf("couldn't allocate a cache of %d blocks\n",cacheblocks);
+		return 1;
+	}
+
+	out = strcmp(outname,"-") ? fopen(outname,"w") : stdout;
+	buffer = malloc(BENCH_FILL_CHUNK);
+	if(!out || !buffer) {
+		printf("couldn't open %s: %s\n",outname,strerror(errno));
+		return 1;
+	}
+	for(i = 0; i < BENCH_FILL_CHUNK; i++)
+		buffer[i] = 'a' + i % 26;
+
+	// Leave room for the inode table and the bitmaps.
+	filesize = (int64_t)disk_size() * DISK_BLOCK_SIZE / 4;
+	if(filesize > BENCH_MAX_FILE)
+		filesize = BENCH_MAX_FILE;
+	filesize -= filesize % BENCH_FILL_CHUNK;
+
+	fprintf(out, "{\n  \"nblocks\": %d, \"cache_blocks\": %d, \"async_threads\": %d, \"backend\": \"%s\", \"format\": \"%s\", \"journal\": %s, \"inline\": %s, \"compress\": %s, \"file_size\": %lld,\n  \"workloads\": [",
+		disk_size(), cacheblocks, asyncthreads, backend == DISK_BACKEND_MMAP ? "mmap" : "pread",
+		formatflags & FS_FORMAT_EXTENTS ? "extents" : "pointers",
+		formatflags & FS_FORMAT_JOURNAL ? "true" : "false",
+		formatflags & FS_FORMAT_INLINE ? "true" : "false", compress ? "true" : "false", (long long)filesize);
+
+	for(i = 0; i < sizeof(seqSizes)/sizeof(seqSizes[0]); i++)
+		sequential(seqSizes[i], filesize);
+	for(i = 0; i < sizeof(randomSizes)/sizeof(randomSizes[0]); i++)
+		random_io(randomSizes[i], filesize);
+	for(i = 0; i < sizeof(randomSizes)/sizeof(randomSizes[0]); i++)
+		async_io(randomSizes[i], filesize);
+	churn();
+	for(nfiles = 16; nfiles <= disk_size() / 4; nfiles *= 8) {
+		mount_time(nfiles, 1);
+		mount_time(nfiles, 0);
+	}
+	fill();
+
+	fprintf(out, "\n  ]\n}\n");
+	if(out != stdout)
+		fclose(out);
+
+	if(mounted)
+		fs_unmount();
+	cache_close();
+	disk_close();
+	free(buffer);
+	return 0;
+}
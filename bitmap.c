@@ -0,0 +1,378 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#define WORD_BITS 64
+#define RUN_SEARCH_LIMIT 32
+
+// Words, summary, free count and cursor may change under concurrent
+// callers, so plain reads and writes of them are relaxed atomics.
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+struct bitmap *bitmap_create( int nbits )
+{
+	struct bitmap *b = malloc(sizeof(struct bitmap));
+	if(!b) return 0;
+
+	b->nbits = nbits;
+	b->nwords = (nbits + WORD_BITS - 1)/WORD_BITS;
+	b->nsummary = (b->nwords + WORD_BITS - 1)/WORD_BITS;
+	b->words = calloc(b->nwords, sizeof(uint64_t));
+	b->summary = calloc(b->nsummary, sizeof(uint64_t));
+	b->nfree = nbits;
+	b->cursor = 0;
+	if(!b->words || !b->summary)
+	{
+		bitmap_delete(b);
+		return 0;
+	}
+
+	// Bits past the end of the map are permanently used.
+	if(nbits % WORD_BITS)
+	{
+		b->words[b->nwords-1] = ~0ULL << (nbits % WORD_BITS);
+	}
+	if(b->nwords % WORD_BITS)
+	{
+		b->summary[b->nsummary-1] = ~0ULL << (b->nwords % WORD_BITS);
+	}
+	return b;
+}
+
+void bitmap_delete( struct bitmap *b )
+{
+	if(!b) return;
+	free(b->words);
+	free(b->summary);
+	free(b);
+}
+
+int bitmap_test( struct bitmap *b, int bit )
+{
+	if(bit < 0 || bit >= b->nbits)
+		return 0;
+	return (LOAD(b->words[bit/WORD_BITS]) >> (bit%WORD_BITS)) & 1;
+}
+
+// Mark word w full in the summary if it is. The word is checked again
+// afterwards so that a bit cleared concurrently does not leave it hidden.
+static void summary_full( struct bitmap *b, int w )
+{
+	uint64_t mask = 1ULL << (w%WORD_BITS);
+	__sync_fetch_and_or(&b->summary[w/WORD_BITS], mask);
+	if(LOAD(b->words[w]) != ~0ULL)
+		__sync_fetch_and_and(&b->summary[w/WORD_BITS], ~mask);
+}
+
+static void summary_free( struct bitmap *b, int w )
+{
+	__sync_fetch_and_and(&b->summary[w/WORD_BITS], ~(1ULL << (w%WORD_BITS)));
+}
+
+// Atomically set the bits of mask in word w. Returns the bits that were
+// clear before, which are the ones this call claimed.
+static uint64_t word_set( struct bitmap *b, int w, uint64_t mask )
+{
+	uint64_t old = __sync_fetch_and_or(&b->words[w], mask);
+	uint64_t claimed = mask & ~old;
+	if(claimed)
+	{
+		__sync_fetch_and_sub(&b->nfree, __builtin_popcountll(claimed));
+		if((old | mask) == ~0ULL)
+			summary_full(b, w);
+	}
+	return claimed;
+}
+
+static uint64_t word_clear( struct bitmap *b, int w, uint64_t mask )
+{
+	uint64_t old = __sync_fetch_and_and(&b->words[w], ~mask);
+	uint64_t released = mask & old;
+	if(released)
+	{
+		__sync_fetch_and_add(&b->nfree, __builtin_popcountll(released));
+		summary_free(b, w);
+	}
+	return released;
+}
+
+void bitmap_set( struct bitmap *b, int bit )
+{
+	if(bit < 0 || bit >= b->nbits)
+		return;
+	word_set(b, bit/WORD_BITS, 1ULL << (bit%WORD_BITS));
+}
+
+void bitmap_clear( struct bitmap *b, int bit )
+{
+	if(bit < 0 || bit >= b->nbits)
+		return;
+	word_clear(b, bit/WORD_BITS, 1ULL << (bit%WORD_BITS));
+}
+
+// Mask of the bits of the range [bit, end) that fall in bit's word.
+static uint64_t range_mask( int bit, int end )
+{
+	int off = bit%WORD_BITS;
+	int n = WORD_BITS - off < end - bit ? WORD_BITS - off : end - bit;
+	return (n == WORD_BITS ? ~0ULL : ((1ULL << n) - 1)) << off;
+}
+
+// Ranges are updated a word at a time.
+void bitmap_set_range( struct bitmap *b, int bit, int count )
+{
+	int end = bit + count;
+	while(bit < end)
+	{
+		word_set(b, bit/WORD_BITS, range_mask(bit, end));
+		bit = (bit/WORD_BITS + 1)*WORD_BITS;
+	}
+}
+
+void bitmap_clear_range( struct bitmap *b, int bit, int count )
+{
+	int end = bit + count;
+	while(bit < end)
+	{
+		word_clear(b, bit/WORD_BITS, range_mask(bit, end));
+		bit = (bit/WORD_BITS + 1)*WORD_BITS;
+	}
+}
+
+// Number of set bits in the range, counted a word at a time.
+int bitmap_test_range( struct bitmap *b, int bit, int count )
+{
+	int end = bit + count;
+	int set = 0;
+	while(bit < end)
+	{
+		set += __builtin_popcountll(LOAD(b->words[bit/WORD_BITS]) & range_mask(bit, end));
+		bit = (bit/WORD_BITS + 1)*WORD_BITS;
+	}
+	return set;
+}
+
+// Index of the first word at or after w (wrapping around) with a free bit.
+static int find_free_word( struct bitmap *b, int w )
+{
+	int s = w/WORD_BITS;
+	uint64_t avail = ~LOAD(b->summary[s]) & (~0ULL << (w%WORD_BITS));
+	int i;
+
+	for(i = 0; i <= b->nsummary; i++)
+	{
+		if(avail)
+			return s*WORD_BITS + __builtin_ctzll(avail);
+		s = (s + 1) % b->nsummary;
+		avail = ~LOAD(b->summary[s]);
+	}
+	return -1;
+}
+
+// Next-fit allocation: continue from the word of the previous allocation.
+// Lock-free: a bit is only taken if this call is the one that set it, so
+// concurrent callers that pick the same bit retry elsewhere.
+int bitmap_alloc( struct bitmap *b )
+{
+	int w = LOAD(b->cursor);
+
+	while(LOAD(b->nfree) > 0)
+	{
+		w = find_free_word(b, w);
+		if(w < 0)
+			return -1;
+
+		uint64_t avail = ~LOAD(b->words[w]);
+		if(!avail)
+		{
+			summary_full(b, w);
+			continue;
+		}
+		uint64_t mask = avail & -avail;
+		if(word_set(b, w, mask))
+		{
+			STORE(b->cursor, w);
+			return w*WORD_BITS + __builtin_ctzll(mask);
+		}
+	}
+	return -1;
+}
+
+// First free bit at or after bit, wrapping around, or -1 if none.
+static int next_free_bit( struct bitmap *b, int bit )
+{
+	int w = bit/WORD_BITS;
+	uint64_t avail = ~LOAD(b->words[w]) & (~0ULL << (bit%WORD_BITS));
+
+	if(avail)
+		return w*WORD_BITS + __builtin_ctzll(avail);
+	w = find_free_word(b, (w + 1) % b->nwords);
+	if(w < 0)
+		return -1;
+	return w*WORD_BITS + __builtin_ctzll(~LOAD(b->words[w]));
+}
+
+// Number of free bits starting at bit, counting no further than max.
+static int free_run_length( struct bitmap *b, int bit, int max )
+{
+	int len = 0;
+	while(len < max && bit < b->nbits)
+	{
+		int off = bit%WORD_BITS;
+		uint64_t used = LOAD(b->words[bit/WORD_BITS]) >> off;
+		int zeros = used ? __builtin_ctzll(used) : WORD_BITS - off;
+		len += zeros;
+		if(zeros < WORD_BITS - off)
+			break;
+		bit += zeros;
+	}
+	return len < max ? len : max;
+}
+
+// Claim free bits from bit onwards, at most max of them, stopping at the
+// first bit that is already used. Returns how many were claimed.
+static int claim_run( struct bitmap *b, int bit, int max )
+{
+	int end = bit + max;
+	int start = bit;
+	while(bit < end)
+	{
+		int w = bit/WORD_BITS;
+		uint64_t mask = range_mask(bit, end);
+		uint64_t used = LOAD(b->words[w]) & mask;
+		if(used)
+			mask &= (used & -used) - 1;
+		if(!mask)
+			break;
+		uint64_t claimed = word_set(b, w, mask);
+		if(claimed != mask)
+		{
+			// Lost a race for part of it: keep the leading bits that were won
+			uint64_t keep = (~claimed & mask) & -(~claimed & mask);
+			keep = (keep - 1) & claimed;
+			word_clear(b, w, claimed & ~keep);
+			bit += __builtin_popcountll(keep);
+			break;
+		}
+		bit += __builtin_popcountll(mask);
+		if(used)
+			break;
+	}
+	return bit - start;
+}
+
+// Allocate up to want contiguous bits, looking first at hint.
+// The longest run seen within a bounded search is taken if no run is long enough.
+// Returns the first bit and sets *got to the run length, or -1 when full.
+// The run is claimed word by word; if another thread takes part of it
+// first, the part claimed up to that point is returned.
+int bitmap_alloc_run( struct bitmap *b, int hint, int want, int *got )
+{
+	int best, bestLen;
+	int bit, len, tries;
+
+	*got = 0;
+	if(want < 1)
+		return -1;
+	if(hint < 0 || hint >= b->nbits)
+		hint = LOAD(b->cursor)*WORD_BITS;
+
+	for(;;)
+	{
+		if(LOAD(b->nfree) <= 0)
+			return -1;
+		best = -1;
+		bestLen = 0;
+		bit = hint;
+		for(tries = 0; tries < RUN_SEARCH_LIMIT && bestLen < want; tries++)
+		{
+			bit = next_free_bit(b, bit);
+			if(bit < 0)
+				break;
+			len = free_run_length(b, bit, want);
+			if(len > bestLen)
+			{
+				best = bit;
+				bestLen = len;
+			}
+			bit += len;
+			if(bit >= b->nbits)
+				bit = 0;
+		}
+		if(best < 0)
+			return -1;
+
+		len = claim_run(b, best, bestLen);
+		if(len > 0)
+		{
+			STORE(b->cursor, (best + len - 1)/WORD_BITS);
+			*got = len;
+			return best;
+		}
+		hint = best;
+	}
+}
+
+// Valid bits of word w, excluding the padding past nbits.
+static uint64_t valid_bits( struct bitmap *b, int w )
+{
+	if(w == b->nwords-1 && b->nbits % WORD_BITS)
+		return ~(~0ULL << (b->nbits % WORD_BITS));
+	return ~0ULL;
+}
+
+// OR src into dst. Returns how many bits were already set in both.
+int bitmap_merge( struct bitmap *dst, struct bitmap *src )
+{
+	int overlap = 0;
+	int w;
+	for(w = 0; w < dst->nwords; w++)
+	{
+		overlap += __builtin_popcountll(dst->words[w] & src->words[w] & valid_bits(dst, w));
+		dst->words[w] |= src->words[w];
+	}
+	bitmap_refresh(dst);
+	return overlap;
+}
+
+// Number of bits set in a but not in b.
+int bitmap_count_diff( struct bitmap *a, struct bitmap *b )
+{
+	int count = 0;
+	int w;
+	for(w = 0; w < a->nwords; w++)
+		count += __builtin_popcountll(a->words[w] & ~b->words[w]);
+	return count;
+}
+
+int bitmap_count_free( struct bitmap *b )
+{
+	int count = 0;
+	int w;
+	for(w = 0; w < b->nwords; w++)
+		count += WORD_BITS - __builtin_popcountll(b->words[w]);
+	return count;
+}
+
+// Recompute the summary and free count after words was filled in directly.
+void bitmap_refresh( struct bitmap *b )
+{
+	int w;
+
+	if(b->nbits % WORD_BITS)
+		b->words[b->nwords-1] |= ~0ULL << (b->nbits % WORD_BITS);
+	memset(b->summary, 0, b->nsummary*sizeof(uint64_t));
+	if(b->nwords % WORD_BITS)
+		b->summary[b->nsummary-1] = ~0ULL << (b->nwords % WORD_BITS);
+
+	for(w = 0; w < b->nwords; w++)
+	{
+		if(b->words[w] == ~0ULL)
+			b->summary[w/WORD_BITS] |= 1ULL << (w%WORD_BITS);
+	}
+	b->nfree = bitmap_count_free(b);
+	b->cursor = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+// A set bit marks a used entry. summary has one bit per word of words,
+// set when that word is full, so free space is found without a linear scan.
+// Setting, clearing and allocating are lock-free and may be called from
+// several threads; create, merge and refresh may not.
+
+struct bitmap {
+	uint64_t *words;
+	uint64_t *summary;
+	int nbits;
+	int nwords;
+	int nsummary;
+	int nfree;
+	int cursor;
+};
+
+struct bitmap *bitmap_create( int nbits );
+void bitmap_delete( struct bitmap *b );
+int  bitmap_test( struct bitmap *b, int bit );
+void bitmap_set( struct bitmap *b, int bit );
+void bitmap_clear( struct bitmap *b, int bit );
+void bitmap_set_range( struct bitmap *b, int bit, int count );
+void bitmap_clear_range( struct bitmap *b, int bit, int count );
+int  bitmap_alloc( struct bitmap *b );
+int  bitmap_alloc_run( struct bitmap *b, int hint, int want, int *got );
+int  bitmap_test_range( struct bitmap *b, int bit, int count );
+int  bitmap_merge( struct bitmap *dst, struct bitmap *src );
+int  bitmap_count_diff( struct bitmap *a, struct bitmap *b );
+int  bitmap_count_free( struct bitmap *b );
+void bitmap_refresh( struct bitmap *b );
+
+#endif
@@ -0,0 +1,653 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "disk.h"
+
+// Write-back block cache with LRU eviction.
+// A cache of size zero passes every request straight through to disk.c.
+// Blocks are spread over shards by block number, each with its own lock,
+// LRU list and hash table, so threads working on different blocks rarely
+// contend. Disk reads for misses happen outside the shard locks.
+// Pinned blocks are dirty blocks that must not reach the disk until the
+// caller unpins them: eviction and flushes pass over them. A shard with
+// every entry pinned grows by an overflow entry instead, and gives it back
+// once it is unpinned. A shard at least half pinned counts as crowded, a
+// sign for the caller to unpin soon.
+
+#define CACHE_MAX_SHARDS       16
+#define CACHE_MIN_SHARD_BLOCKS 16
+
+struct cache_entry {
+	int blocknum;
+	int dirty;
+	int pinned;
+	int prefetched;
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	struct cache_entry *hnext;
+	char data[DISK_BLOCK_SIZE];
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry *entries;
+	struct cache_entry **buckets;
+	struct cache_entry lru;
+	int nentries;
+	int nbuckets;
+	int npinned;
+	int noverflow;
+	int nhits;
+	int nmisses;
+	int nwritebacks;
+	int nprefetchhits;
+	int nprefetchwasted;
+};
+
+static struct cache_entry *entries=0;
+static struct cache_shard *shards=0;
+static int nshards=0;
+static int nentries=0;
+static int npinned=0;
+static int ncrowded=0;
+
+static void lru_remove( struct cache_entry *e )
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push_front( struct cache_shard *s, struct cache_entry *e )
+{
+	e->next = s->lru.next;
+	e->prev = &s->lru;
+	s->lru.next->prev = e;
+	s->lru.next = e;
+}
+
+// Lock and return the shard holding blocknum.
+static struct cache_shard *shard_lock( int blocknum )
+{
+	struct cache_shard *s = &shards[blocknum & (nshards-1)];
+	pthread_mutex_lock(&s->lock);
+	return s;
+}
+
+static struct cache_entry **hash_slot( struct cache_shard *s, int blocknum )
+{
+	return &s->buckets[(blocknum/nshards) & (s->nbuckets-1)];
+}
+
+static void hash_remove( struct cache_shard *s, struct cache_entry *e )
+{
+	struct cache_entry **p = hash_slot(s, e->blocknum);
+	while(*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+	e->hnext = 0;
+}
+
+static struct cache_entry *lookup( struct cache_shard *s, int blocknum )
+{
+	struct cache_entry *e;
+	for(e = *hash_slot(s, blocknum); e; e = e->hnext)
+	{
+		if(e->blocknum == blocknum)
+			return e;
+	}
+	return 0;
+}
+
+// A cached block is used: move it to the front and count a read-ahead hit
+// the first time a prefetched block is asked for.
+static void touch( struct cache_shard *s, struct cache_entry *e )
+{
+	s->nhits++;
+	if(e->prefetched)
+	{
+		s->nprefetchhits++;
+		e->prefetched = 0;
+	}
+	lru_remove(e);
+	lru_push_front(s, e);
+}
+
+static int crowded( struct cache_shard *s )
+{
+	return s->npinned*2 >= s->nentries;
+}
+
+static void pin( struct cache_shard *s, struct cache_entry *e )
+{
+	if(!e->pinned)
+	{
+		int was = crowded(s);
+		e->pinned = 1;
+		s->npinned++;
+		__sync_fetch_and_add(&npinned, 1);
+		if(!was && crowded(s))
+			__sync_fetch_and_add(&ncrowded, 1);
+	}
+}
+
+static void unpin( struct cache_shard *s, struct cache_entry *e )
+{
+	if(e->pinned)
+	{
+		int was = crowded(s);
+		e->pinned = 0;
+		s->npinned--;
+		__sync_fetch_and_sub(&npinned, 1);
+		if(was && !crowded(s))
+			__sync_fetch_and_sub(&ncrowded, 1);
+	}
+}
+
+static int overflowed( struct cache_shard *s, struct cache_entry *e )
+{
+	return e < s->entries || e >= s->entries + s->nentries;
+}
+
+// Write back and drop a cached block, leaving its entry unused.
+static void drop( struct cache_shard *s, struct cache_entry *e )
+{
+	if(e->prefetched)
+		s->nprefetchwasted++;
+	if(e->dirty)
+	{
+		disk_write(e->blocknum, e->data);
+		s->nwritebacks++;
+	}
+	hash_remove(s, e);
+}
+
+// Free the overflow entries of a shard that are no longer pinned.
+static void shrink( struct cache_shard *s )
+{
+	struct cache_entry *e = s->lru.prev;
+
+	while(e != &s->lru && s->noverflow > 0)
+	{
+		struct cache_entry *prev = e->prev;
+		if(!e->pinned && overflowed(s, e))
+		{
+			drop(s, e);
+			lru_remove(e);
+			free(e);
+			s->noverflow--;
+		}
+		e = prev;
+	}
+}
+
+// Take the least recently used unpinned entry of the shard, writing it back
+// if it is dirty, and move it to the front for blocknum. If every entry is
+// pinned, none of them can be written yet, so the shard grows instead.
+static struct cache_entry *evict( struct cache_shard *s, int blocknum )
+{
+	struct cache_entry *e;
+
+	if(s->noverflow > 0)
+		shrink(s);
+	e = s->lru.prev;
+	while(e != &s->lru && e->pinned)
+		e = e->prev;
+
+	if(e == &s->lru)
+	{
+		e = malloc(sizeof(struct cache_entry));
+		if(!e)
+		{
+			printf("ERROR: couldn't grow the cache past %d pinned blocks!\n",npinned);
+			abort();
+		}
+		lru_push_front(s, e);
+		s->noverflow++;
+	}
+	else if(e->blocknum >= 0)
+	{
+		drop(s, e);
+	}
+
+	e->blocknum = blocknum;
+	e->dirty = 0;
+	e->pinned = 0;
+	e->prefetched = 0;
+	e->hnext = *hash_slot(s, blocknum);
+	*hash_slot(s, blocknum) = e;
+	lru_remove(e);
+	lru_push_front(s, e);
+	return e;
+}
+
+// Cache a block just read from disk into data. If another thread cached
+// it in the meantime and has changed it since, that copy replaces data.
+static void fill( int blocknum, char *data, int prefetched )
+{
+	struct cache_shard *s = shard_lock(blocknum);
+	struct cache_entry *e = lookup(s, blocknum);
+	if(e)
+	{
+		if(e->dirty)
+			memcpy(data, e->data, DISK_BLOCK_SIZE);
+	}
+	else
+	{
+		e = evict(s, blocknum);
+		memcpy(e->data, data, DISK_BLOCK_SIZE);
+		e->prefetched = prefetched;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void shards_free(void)
+{
+	struct cache_entry *e, *next;
+	int i;
+	for(i = 0; i < nshards; i++)
+	{
+		for(e = shards[i].lru.next; shards[i].noverflow > 0 && e != &shards[i].lru; e = next)
+		{
+			next = e->next;
+			if(overflowed(&shards[i], e))
+				free(e);
+		}
+		free(shards[i].buckets);
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+	free(entries);
+	free(shards);
+	entries = 0;
+	shards = 0;
+	nentries = 0;
+	nshards = 0;
+}
+
+int cache_init( int n )
+{
+	int i, j;
+
+	cache_close();
+
+	if(n <= 0)
+		return 1;
+
+	nshards = 1;
+	while(nshards < CACHE_MAX_SHARDS && n/(nshards*2) >= CACHE_MIN_SHARD_BLOCKS)
+		nshards *= 2;
+
+	entries = malloc(n * sizeof(struct cache_entry));
+	shards = calloc(nshards, sizeof(struct cache_shard));
+	if(!entries || !shards)
+	{
+		nshards = 0;
+		shards_free();
+		return 0;
+	}
+
+	for(i = 0; i < nshards; i++)
+	{
+		struct cache_shard *s = &shards[i];
+		pthread_mutex_init(&s->lock, 0);
+		s->entries = &entries[i*(n/nshards)];
+		s->nentries = (i == nshards-1 ? n - i*(n/nshards) : n/nshards);
+		s->nbuckets = 1;
+		while(s->nbuckets < s->nentries)
+			s->nbuckets *= 2;
+		s->buckets = calloc(s->nbuckets, sizeof(struct cache_entry *));
+		if(!s->buckets)
+		{
+			nshards = i+1;
+			shards_free();
+			return 0;
+		}
+
+		s->lru.next = s->lru.prev = &s->lru;
+		for(j = 0; j < s->nentries; j++)
+		{
+			s->entries[j].blocknum = -1;
+			s->entries[j].dirty = 0;
+			s->entries[j].pinned = 0;
+			s->entries[j].prefetched = 0;
+			s->entries[j].hnext = 0;
+			lru_push_front(s, &s->entries[j]);
+		}
+	}
+
+	nentries = n;
+	npinned = 0;
+	ncrowded = 0;
+	return 1;
+}
+
+// Copy blocknum out of the cache into data if it is there. Otherwise count
+// a miss and return 0.
+static int read_hit( int blocknum, char *data )
+{
+	struct cache_shard *s = shard_lock(blocknum);
+	struct cache_entry *e = lookup(s, blocknum);
+	if(e)
+	{
+		touch(s, e);
+		memcpy(data, e->data, DISK_BLOCK_SIZE);
+	}
+	else
+	{
+		s->nmisses++;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return e != 0;
+}
+
+void cache_read( int blocknum, char *data )
+{
+	if(nentries == 0)
+	{
+		disk_read(blocknum, data);
+		return;
+	}
+
+	if(read_hit(blocknum, data))
+		return;
+	disk_read(blocknum, data);
+	fill(blocknum, data, 0);
+}
+
+static void write_block( int blocknum, const char *data, int pinned )
+{
+	struct cache_shard *s;
+	struct cache_entry *e;
+
+	if(nentries == 0)
+	{
+		disk_write(blocknum, data);
+		return;
+	}
+
+	s = shard_lock(blocknum);
+	e = lookup(s, blocknum);
+	if(e)
+	{
+		lru_remove(e);
+		lru_push_front(s, e);
+	}
+	else
+	{
+		e = evict(s, blocknum);
+	}
+	memcpy(e->data, data, DISK_BLOCK_SIZE);
+	e->dirty = 1;
+	e->prefetched = 0;
+	if(pinned)
+		pin(s, e);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void cache_write( int blocknum, const char *data )
+{
+	write_block(blocknum, data, 0);
+}
+
+// Like cache_write, but the block stays in memory until cache_unpin.
+// Without a cache it is written through, so callers that rely on pinning
+// need one.
+void cache_write_pinned( int blocknum, const char *data )
+{
+	write_block(blocknum, data, 1);
+}
+
+// Let a pinned block be written back like any other dirty block.
+void cache_unpin( int blocknum )
+{
+	struct cache_shard *s;
+	struct cache_entry *e;
+
+	if(nentries == 0)
+		return;
+
+	s = shard_lock(blocknum);
+	e = lookup(s, blocknum);
+	if(e)
+		unpin(s, e);
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Store the numbers of up to max pinned blocks in blocknums and return how
+// many there are in all.
+int cache_pinned( int *blocknums, int max )
+{
+	struct cache_entry *e;
+	int i, n = 0;
+	for(i = 0; i < nshards; i++)
+	{
+		struct cache_shard *s = &shards[i];
+		pthread_mutex_lock(&s->lock);
+		for(e = s->lru.next; e != &s->lru; e = e->next)
+		{
+			if(e->blocknum >= 0 && e->pinned)
+			{
+				if(n < max)
+					blocknums[n] = e->blocknum;
+				n++;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	return n;
+}
+
+int cache_npinned()
+{
+	return __atomic_load_n(&npinned, __ATOMIC_RELAXED);
+}
+
+// Whether some shard is at least half pinned.
+int cache_crowded()
+{
+	return __atomic_load_n(&ncrowded, __ATOMIC_RELAXED) > 0;
+}
+
+int cache_nblocks()
+{
+	return nentries;
+}
+
+// Whether blocknum is cached, counting a miss if not and miss is set.
+static int cached( int blocknum, int miss )
+{
+	struct cache_shard *s = shard_lock(blocknum);
+	struct cache_entry *e = lookup(s, blocknum);
+	if(!e && miss)
+		s->nmisses++;
+	pthread_mutex_unlock(&s->lock);
+	return e != 0;
+}
+
+// Runs of blocks: cached copies are served from memory and the remaining
+// misses go to disk in as few disk_readv calls as possible.
+void cache_readv( int blocknum, int count, char *data[] )
+{
+	int i, start;
+
+	if(nentries == 0)
+	{
+		disk_readv(blocknum, count, data);
+		return;
+	}
+
+	for(i = 0; i < count; )
+	{
+		if(read_hit(blocknum+i, data[i]))
+		{
+			i++;
+			continue;
+		}
+
+		start = i++;
+		while(i < count && !cached(blocknum+i, 1))
+			i++;
+		disk_readv(blocknum+start, i-start, &data[start]);
+		for(; start < i; start++)
+			fill(blocknum+start, data[start], 0);
+	}
+}
+
+// Runs of blocks are written through with one disk_writev.
+// Cached copies are refreshed and become clean.
+void cache_writev( int blocknum, int count, const char *const data[] )
+{
+	struct cache_shard *s;
+	struct cache_entry *e;
+	int i;
+
+	for(i = 0; i < count && nentries > 0; i++)
+	{
+		s = shard_lock(blocknum+i);
+		e = lookup(s, blocknum+i);
+		if(e)
+		{
+			memcpy(e->data, data[i], DISK_BLOCK_SIZE);
+			e->dirty = 0;
+			e->prefetched = 0;
+			unpin(s, e);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	disk_writev(blocknum, count, data);
+}
+
+// Merge length bytes at offset from into a block through its cached copy,
+// so that several small writes to one block reach the disk as a single
+// write-back. A fresh block starts zeroed instead of being read first.
+void cache_update( int blocknum, const char *data, int from, int length, int fresh )
+{
+	struct cache_shard *s;
+	struct cache_entry *e;
+
+	if(nentries == 0)
+	{
+		char block[DISK_BLOCK_SIZE];
+		if(fresh)
+			memset(block, 0, DISK_BLOCK_SIZE);
+		else
+			disk_read(blocknum, block);
+		memcpy(&block[from], data, length);
+		disk_write(blocknum, block);
+		return;
+	}
+
+	s = shard_lock(blocknum);
+	e = lookup(s, blocknum);
+	if(e)
+	{
+		touch(s, e);
+	}
+	else if(fresh)
+	{
+		e = evict(s, blocknum);
+	}
+	else
+	{
+		// Read a miss outside the lock, then look again: a copy cached by
+		// another thread in the meantime is at least as new as the disk.
+		char block[DISK_BLOCK_SIZE];
+		s->nmisses++;
+		pthread_mutex_unlock(&s->lock);
+		disk_read(blocknum, block);
+		s = shard_lock(blocknum);
+		e = lookup(s, blocknum);
+		if(!e)
+		{
+			e = evict(s, blocknum);
+			memcpy(e->data, block, DISK_BLOCK_SIZE);
+		}
+	}
+	if(fresh)
+		memset(e->data, 0, DISK_BLOCK_SIZE);
+	memcpy(&e->data[from], data, length);
+	e->dirty = 1;
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Read blocks that are not cached yet into the cache ahead of use, one
+// disk_readv per run of misses. They do not count as hits or misses until
+// they are read; any evicted unread count as wasted.
+void cache_prefetch( int blocknum, int count )
+{
+	char *bufs[CACHE_MAX_PREFETCH];
+	char *staging;
+	int i, j, n;
+
+	if(count > nentries/2)
+		count = nentries/2;
+	if(count > CACHE_MAX_PREFETCH)
+		count = CACHE_MAX_PREFETCH;
+	if(count <= 0)
+		return;
+
+	// Read-ahead is only a hint, so without memory for it there is none
+	staging = malloc(count * DISK_BLOCK_SIZE);
+	if(!staging)
+		return;
+	for(i = 0; i < count; i += n + 1)
+	{
+		for(n = 0; i+n < count && !cached(blocknum+i+n, 0); n++)
+			bufs[n] = &staging[n*DISK_BLOCK_SIZE];
+		if(n == 0)
+			continue;
+		disk_readv(blocknum+i, n, bufs);
+		for(j = 0; j < n; j++)
+			fill(blocknum+i+j, bufs[j], 1);
+	}
+	free(staging);
+}
+
+void cache_flush()
+{
+	struct cache_entry *e;
+	int i;
+	for(i = 0; i < nshards; i++)
+	{
+		struct cache_shard *s = &shards[i];
+		pthread_mutex_lock(&s->lock);
+		for(e = s->lru.next; e != &s->lru; e = e->next)
+		{
+			if(e->blocknum >= 0 && e->dirty && !e->pinned)
+			{
+				disk_write(e->blocknum, e->data);
+				e->dirty = 0;
+				s->nwritebacks++;
+			}
+		}
+		shrink(s);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+void cache_close()
+{
+	int hits=0, misses=0, writebacks=0, prefetchhits=0, prefetchwasted=0;
+	int i;
+
+	if(entries) {
+		cache_flush();
+		for(i = 0; i < nshards; i++)
+		{
+			hits += shards[i].nhits;
+			misses += shards[i].nmisses;
+			writebacks += shards[i].nwritebacks;
+			prefetchhits += shards[i].nprefetchhits;
+			prefetchwasted += shards[i].nprefetchwasted;
+		}
+		printf("%d cache hits\n",hits);
+		printf("%d cache misses\n",misses);
+		printf("%d cache writebacks\n",writebacks);
+		printf("%d read-ahead hits\n",prefetchhits);
+		printf("%d wasted prefetches\n",prefetchwasted);
+		shards_free();
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_DEFAULT_BLOCKS 256
+#define CACHE_MAX_PREFETCH   256
+
+int  cache_init( int nblocks );
+void cache_read( int blocknum, char *data );
+void cache_write( int blocknum, const char *data );
+void cache_write_pinned( int blocknum, const char *data );
+void cache_unpin( int blocknum );
+int  cache_pinned( int *blocknums, int max );
+int  cache_npinned();
+int  cache_crowded();
+int  cache_nblocks();
+void cache_readv( int blocknum, int count, char *data[] );
+void cache_writev( int blocknum, int count, const char *const data[] );
+void cache_update( int blocknum, const char *data, int from, int length, int fresh );
+void cache_prefetch( int blocknum, int count );
+void cache_flush();
+void cache_close();
+
+#endif
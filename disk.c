@@ -4,24 +4,54 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define DISK_MAGIC 0xdeadbeef
+#define DISK_MAX_IOV 1024
 
-static FILE *diskfile;
+// Every transfer names its own offset with pread/pwrite, so the disk can be
+// used from several threads at once without a shared file position.
+static int diskfd=-1;
+static char *diskmap=0;
+static int backend=DISK_BACKEND_PREAD;
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static FILE *tracefile=0;
+static int64_t tracestart=0;
 
-int disk_init( const char *filename, int n )
+static off_t block_offset( int blocknum )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return (off_t)blocknum*DISK_BLOCK_SIZE;
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+int disk_init( const char *filename, int n, int b )
+{
+	diskfd = open(filename,O_RDWR|O_CREAT,0666);
+	if(diskfd<0) return 0;
 
+	if(ftruncate(diskfd,block_offset(n))<0) {
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	if(b==DISK_BACKEND_MMAP) {
+		diskmap = mmap(0,block_offset(n),PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0);
+		if(diskmap==MAP_FAILED) {
+			diskmap = 0;
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+	}
+
+	backend = b;
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
@@ -34,6 +64,32 @@ int disk_size()
 	return nblocks;
 }
 
+int disk_nreads()
+{
+	return nreads;
+}
+
+int disk_nwrites()
+{
+	return nwrites;
+}
+
+// Append one record to the block trace, if one is being taken. Each record
+// goes out in a single fwrite, which stdio serializes between threads.
+static void trace( int op, int blocknum, int count )
+{
+	struct disk_trace_record r;
+
+	if(!tracefile) return;
+
+	r.time = stats_start()-tracestart;
+	r.blocknum = blocknum;
+	r.count = count;
+	r.op = op;
+	r.unused = 0;
+	fwrite(&r,sizeof(r),1,tracefile);
+}
+
 static void sanity_check( int blocknum, const void *data )
 {
 	if(blocknum<0) {
@@ -54,39 +110,177 @@ static void sanity_check( int blocknum, const void *data )
 
 void disk_read( int blocknum, char *data )
 {
-	sanity_check(blocknum,data);
+	int64_t start = stats_start();
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(blocknum,data);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
-	} else {
+	if(backend==DISK_BACKEND_MMAP) {
+		memcpy(data,&diskmap[block_offset(blocknum)],DISK_BLOCK_SIZE);
+	} else if(pread(diskfd,data,DISK_BLOCK_SIZE,block_offset(blocknum))!=DISK_BLOCK_SIZE) {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+	__sync_fetch_and_add(&nreads,1);
+	trace(DISK_TRACE_READ,blocknum,1);
+	stats_record(STATS_DISK_READ,start,DISK_BLOCK_SIZE);
 }
 
 void disk_write( int blocknum, const char *data )
 {
-	sanity_check(blocknum,data);
+	int64_t start = stats_start();
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(blocknum,data);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
-	} else {
+	if(backend==DISK_BACKEND_MMAP) {
+		memcpy(&diskmap[block_offset(blocknum)],data,DISK_BLOCK_SIZE);
+	} else if(pwrite(diskfd,data,DISK_BLOCK_SIZE,block_offset(blocknum))!=DISK_BLOCK_SIZE) {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+	__sync_fetch_and_add(&nwrites,1);
+	trace(DISK_TRACE_WRITE,blocknum,1);
+	stats_record(STATS_DISK_WRITE,start,DISK_BLOCK_SIZE);
+}
+
+// Transfer the run of count blocks starting at blocknum with one call,
+// scattering into or gathering from one buffer per block.
+
+void disk_readv( int blocknum, int count, char *data[] )
+{
+	struct iovec iov[DISK_MAX_IOV];
+	int64_t start = stats_start();
+	int i, j, n;
+
+	for(i=0;i<count;i++) sanity_check(blocknum+i,data[i]);
+
+	for(i=0;i<count;i+=n) {
+		n = count-i < DISK_MAX_IOV ? count-i : DISK_MAX_IOV;
+		if(backend==DISK_BACKEND_MMAP) {
+			for(j=0;j<n;j++) memcpy(data[i+j],&diskmap[block_offset(blocknum+i+j)],DISK_BLOCK_SIZE);
+		} else {
+			for(j=0;j<n;j++) {
+				iov[j].iov_base = data[i+j];
+				iov[j].iov_len = DISK_BLOCK_SIZE;
+			}
+			if(preadv(diskfd,iov,n,block_offset(blocknum+i))!=(ssize_t)n*DISK_BLOCK_SIZE) {
+				printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+				abort();
+			}
+		}
+		__sync_fetch_and_add(&nreads,n);
+		trace(DISK_TRACE_READ,blocknum+i,n);
+	}
+	stats_record(STATS_DISK_READ,start,(int64_t)count*DISK_BLOCK_SIZE);
+}
+
+void disk_writev( int blocknum, int count, const char *const data[] )
+{
+	struct iovec iov[DISK_MAX_IOV];
+	int64_t start = stats_start();
+	int i, j, n;
+
+	for(i=0;i<count;i++) sanity_check(blocknum+i,data[i]);
+
+	for(i=0;i<count;i+=n) {
+		n = count-i < DISK_MAX_IOV ? count-i : DISK_MAX_IOV;
+		if(backend==DISK_BACKEND_MMAP) {
+			for(j=0;j<n;j++) memcpy(&diskmap[block_offset(blocknum+i+j)],data[i+j],DISK_BLOCK_SIZE);
+		} else {
+			for(j=0;j<n;j++) {
+				iov[j].iov_base = (char *)data[i+j];
+				iov[j].iov_len = DISK_BLOCK_SIZE;
+			}
+			if(pwritev(diskfd,iov,n,block_offset(blocknum+i))!=(ssize_t)n*DISK_BLOCK_SIZE) {
+				printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+				abort();
+			}
+		}
+		__sync_fetch_and_add(&nwrites,n);
+		trace(DISK_TRACE_WRITE,blocknum+i,n);
+	}
+	stats_record(STATS_DISK_WRITE,start,(int64_t)count*DISK_BLOCK_SIZE);
+}
+
+// Zero-copy access for the mmap backend: returns a pointer into the mapping,
+// or null if the backend cannot lend one. Release with dirty set if changed.
+
+char *disk_borrow( int blocknum )
+{
+	if(backend!=DISK_BACKEND_MMAP) return 0;
+
+	sanity_check(blocknum,diskmap);
+
+	__sync_fetch_and_add(&nreads,1);
+	trace(DISK_TRACE_READ,blocknum,1);
+	return &diskmap[block_offset(blocknum)];
+}
+
+void disk_release( int blocknum, int dirty )
+{
+	if(backend!=DISK_BACKEND_MMAP) return;
+
+	sanity_check(blocknum,diskmap);
+
+	if(dirty) {
+		__sync_fetch_and_add(&nwrites,1);
+		trace(DISK_TRACE_WRITE,blocknum,1);
+	}
+}
+
+void disk_sync()
+{
+	if(diskfd<0) return;
+
+	if(backend==DISK_BACKEND_MMAP) {
+		msync(diskmap,block_offset(nblocks),MS_SYNC);
+	} else {
+		fsync(diskfd);
+	}
+}
+
+// Start logging every block transfer to filename, replacing any trace
+// already being taken, or stop tracing if filename is null.
+int disk_trace( const char *filename )
+{
+	struct disk_trace_header h;
+
+	if(tracefile) {
+		fclose(tracefile);
+		tracefile = 0;
+	}
+	if(!filename) return 1;
+
+	FILE *file = fopen(filename,"w");
+	if(!file) return 0;
+
+	h.magic = DISK_TRACE_MAGIC;
+	h.blocksize = DISK_BLOCK_SIZE;
+	h.nblocks = nblocks;
+	h.unused = 0;
+	if(fwrite(&h,sizeof(h),1,file)!=1) {
+		fclose(file);
+		return 0;
+	}
+
+	tracestart = stats_start();
+	tracefile = file;
+	return 1;
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	disk_trace(0);
+
+	if(diskfd>=0) {
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		if(diskmap) {
+			msync(diskmap,block_offset(nblocks),MS_SYNC);
+			munmap(diskmap,block_offset(nblocks));
+			diskmap = 0;
+		}
+		close(diskfd);
+		diskfd = -1;
 	}
 }
 
@@ -1,12 +1,46 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+
 #define DISK_BLOCK_SIZE 4096
 
-int  disk_init( const char *filename, int nblocks );
+#define DISK_BACKEND_PREAD 0
+#define DISK_BACKEND_MMAP  1
+
+// A block trace is one disk_trace_header followed by one record per
+// transfer of count consecutive blocks, in the order they happened.
+#define DISK_TRACE_MAGIC 0x74726163
+#define DISK_TRACE_READ  0
+#define DISK_TRACE_WRITE 1
+
+struct disk_trace_header {
+	uint32_t magic;
+	uint32_t blocksize;
+	int32_t nblocks;
+	uint32_t unused;
+};
+
+struct disk_trace_record {
+	uint64_t time;		// nanoseconds since the trace started
+	int32_t blocknum;
+	uint16_t count;
+	uint8_t op;
+	uint8_t unused;
+};
+
+int  disk_init( const char *filename, int nblocks, int backend );
 int  disk_size();
+int  disk_nreads();
+int  disk_nwrites();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_readv( int blocknum, int count, char *data[] );
+void disk_writev( int blocknum, int count, const char *const data[] );
+char *disk_borrow( int blocknum );
+void disk_release( int blocknum, int dirty );
+void disk_sync();
+int  disk_trace( const char *filename );
 void disk_close();
 
 
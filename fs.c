@@ -1,18 +1,56 @@
 
+#define _GNU_SOURCE
+
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "stats.h"
+#include "lz.h"
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 
-#define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
-#define POINTERS_PER_INODE 5
+#define FS_MAGIC           0xf0f03411
+#define FS_VERSION         2
+#define INLINE_INODE_SIZE  256
+#define POINTERS_PER_INODE 9
 #define POINTERS_PER_BLOCK 1024
+#define INDIRECT_LEVELS    3
+// Direct blocks, then the single, double and triple indirect trees
+#define MAX_FILE_BLOCKS    ((int64_t)POINTERS_PER_INODE + POINTERS_PER_BLOCK + (int64_t)POINTERS_PER_BLOCK*POINTERS_PER_BLOCK + (int64_t)POINTERS_PER_BLOCK*POINTERS_PER_BLOCK*POINTERS_PER_BLOCK)
 #define BYTES_PER_BLOCK 4096
+#define BITS_PER_BLOCK  (BYTES_PER_BLOCK*8)
+#define WORDS_PER_BLOCK (BYTES_PER_BLOCK/8)
+#define MAX_RUN_BLOCKS  256
+#define EXTENTS_PER_INODE  2
+#define EXTENTS_PER_BLOCK  511
+#define MAX_EXTENT_BLOCKS  64
+#define MAX_EXTENTS        (EXTENTS_PER_INODE + MAX_EXTENT_BLOCKS*EXTENTS_PER_BLOCK)
+#define MAX_RESERVATIONS   64
+#define MAX_SCAN_THREADS   16
+#define MIN_SCAN_BLOCKS    64
+#define MAX_STREAMS        64
+#define MIN_READAHEAD      4
+#define INODE_LOCKS        1024
+#define JOURNAL_MAGIC      0x6a726e6c
+#define JOURNAL_HEADER     0
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT     2
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 4096
+#define JOURNAL_TAGS       ((BYTES_PER_BLOCK - 24)/4)
+#define DIR_MAX_DEPTH      9
+#define DIR_SUBINDEX       -1
+#define DIRENTS_PER_BLOCK  ((BYTES_PER_BLOCK - 8)/(int)sizeof(struct fs_dirent))
+#define CHUNK_BLOCKS       4
+#define CHUNK_BYTES        (CHUNK_BLOCKS*BYTES_PER_BLOCK)
+#define MAX_CHUNKS         (MAX_FILE_BLOCKS/CHUNK_BLOCKS)
 
 
 
@@ -21,19 +59,121 @@ struct fs_superblock {
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int flags;
+	int nbitmapblocks;
+	int clean;
+	int journalblocks;
+	int version;
+};
+
+// With FS_FORMAT_JOURNAL a journal region follows the saved bitmaps. Its
+// first block is a header giving the sequence number of the first
+// transaction still to be replayed; transactions follow it, each a
+// descriptor naming the home blocks of the copies after it, then a commit
+// block with the same sequence number and count.
+struct fs_journal {
+	int magic;
+	int type;
+	int64_t sequence;
+	int count;
+	int needscan;
+	int blocknums[JOURNAL_TAGS];
+};
+
+struct fs_extent {
+	int start;
+	int length;
+};
+
+// Extents past the ones in the inode go in a chain of extent blocks, each
+// naming the next.
+struct fs_extentblock {
+	int next;
+	int unused;
+	struct fs_extent extent[EXTENTS_PER_BLOCK];
 };
 
+// A directory is an inode flagged INODE_DIR whose blocks hold a hashed
+// index of its names, so that a lookup reads two blocks, or three in a big
+// directory, however many entries it has. Block 0 is the index: 2^depth
+// slots, each giving the leaf block that holds the names whose hash ends in
+// the slot number's low bits. A full leaf is split in two on its next hash
+// bit, doubling the index first if the leaf is already as deep as it. Once
+// the index is DIR_MAX_DEPTH deep, a full leaf as deep as it gets a second
+// level index of its own over the next DIR_MAX_DEPTH hash bits instead; its
+// slot in block 0 holds the negated block number, and its nentries is
+// DIR_SUBINDEX. A leaf's depth counts hash bits from the first level. The
+// root directory is inode 0, made on first use.
+struct fs_dirent {
+	int inumber;
+	char isdir;
+	char name[FS_NAME_MAX+1];
+};
+
+struct fs_dirindex {
+	int depth;
+	int nentries;
+	int leaf[1 << DIR_MAX_DEPTH];
+};
+
+struct fs_dirleaf {
+	int depth;
+	int count;
+	struct fs_dirent entry[DIRENTS_PER_BLOCK];
+};
+
+// With FS_FORMAT_EXTENTS every inode maps its blocks as a list of extents,
+// the first EXTENTS_PER_INODE in the inode and the rest in a chain of up to
+// MAX_EXTENT_BLOCKS extent blocks starting at extentblock.
+// Otherwise blocks past the direct pointers hang off single, double and
+// triple indirect trees of pointer blocks. A zero pointer is unallocated,
+// and so is an extent starting at block 0. Files may have such holes
+// anywhere; they take no blocks and read as zeros.
 struct fs_inode {
 	int isvalid;
-	int size;
-	int direct[POINTERS_PER_INODE];
-	int indirect;
+	int flags;
+	int64_t size;
+	union {
+		struct {
+			int direct[POINTERS_PER_INODE];
+			int indirect;
+			int dindirect;
+			int tindirect;
+		};
+		struct {
+			struct fs_extent extent[EXTENTS_PER_INODE];
+			int nextents;
+			int extentblock;
+		};
+	};
 };
 
+// With FS_FORMAT_INLINE inodes are INLINE_INODE_SIZE bytes instead, and a
+// file flagged INODE_INLINE keeps its contents in the inode, starting where
+// the block map would be, until it outgrows INLINE_DATA_BYTES.
+#define INODE_INLINE       1
+#define INODE_DIR          2
+#define INLINE_DATA_BYTES  ((int)(INLINE_INODE_SIZE - offsetof(struct fs_inode, direct)))
+
+// A file flagged INODE_COMPRESSED is stored in chunks of CHUNK_BYTES, chunk
+// c in logical blocks c*CHUNK_BLOCKS onwards of the usual block map. A
+// chunk mapped to all CHUNK_BLOCKS blocks is stored as is, one mapped to
+// none is all zeros, and one mapped to fewer holds a 4 byte length and then
+// the lz_compress output, with the rest of its blocks left as holes.
+#define INODE_COMPRESSED   4
+
+// An inode flagged INODE_NAMED has an entry in a directory, and only loses
+// it through fs_unlink or fs_rmdir, never fs_delete.
+#define INODE_NAMED        8
+
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
+	uint64_t words[WORDS_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
+	struct fs_extentblock extents;
+	struct fs_journal journal;
+	struct fs_dirindex dirindex;
+	struct fs_dirleaf dirleaf;
 	char data[DISK_BLOCK_SIZE];
 };
 
@@ -41,820 +181,3748 @@ union fs_block {
 // Global Variables
 
 _Bool fs_mounted = 0;
-_Bool *bitmap;
-int bitmapSize = 0;
+struct bitmap *bitmap;
+
+// Resident metadata while mounted: the superblock and the inode blocks,
+// each read on first use. Changed inode blocks are marked dirty and
+// written back by inode_sync().
+struct fs_superblock superBlock;
+union fs_block **inodeTable;
+_Bool *inodeDirty;
+
+// Set bits mark inodes in use; fs_create allocates from it like blocks.
+struct bitmap *inodeMap;
+
+// Blocks reserved ahead of files being written so that each grows into a
+// contiguous run. Reserved blocks are marked used in the bitmap until the
+// file takes them or the reservation is dropped. Each inode has one slot,
+// shared with others of the same number modulo MAX_RESERVATIONS.
+struct reservation {
+	pthread_mutex_t lock;
+	int inumber;
+	int start;
+	int length;
+};
+struct reservation reservations[MAX_RESERVATIONS];
+int preallocBlocks = FS_DEFAULT_PREALLOC;
+
+// Recent sequential readers, one slot per inode like reservations. A read
+// that starts at the block where the last one ended doubles the read-ahead
+// window up to readaheadBlocks; any other read resets it.
+struct stream {
+	pthread_mutex_t lock;
+	int inumber;
+	int next;
+	int window;
+	int ahead;
+};
+struct stream streams[MAX_STREAMS];
+int readaheadBlocks = FS_DEFAULT_READAHEAD;
+
+// The fs_* calls on files may come from many threads. Each inode is
+// guarded by a reader/writer lock, striped over INODE_LOCKS; fs_read and
+// fs_getsize share it, the calls that change an inode hold it exclusively.
+// The bitmaps are lock-free and the cache is sharded. Formatting, mounting,
+// unmounting, checking and fs_debug must not race with anything else.
+pthread_rwlock_t inodeLocks[INODE_LOCKS];
+pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t locksOnce = PTHREAD_ONCE_INIT;
+
+// Group commit: fs_sync calls that arrive while a commit is being written
+// wait for the next one, which covers all of them. With commitInterval set,
+// every that many calls that change files trigger a commit. The calls that
+// change files hold commitGate shared; a commit holds it exclusively.
+pthread_rwlock_t commitGate;
+pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commitDone = PTHREAD_COND_INITIALIZER;
+int64_t commitsRequested = 0;
+int64_t commitsDone = 0;
+_Bool committing = 0;
+_Bool commitFailed = 0;
+int commitInterval = 0;
+int pendingUpdates = 0;
+
+// The next transaction goes at journalPos blocks into the journal, with
+// sequence number journalSeq. With a journal, blocks freed by a delete stay
+// allocated in pendingFree until the commit that records the delete, so
+// that nothing can overwrite them while the last commit still refers to
+// them. journaledBlocks marks the pointer and extent blocks logged since the
+// journal was last emptied.
+int64_t journalSeq = 0;
+int journalPos = 0;
+struct bitmap *pendingFree;
+struct bitmap *journaledBlocks;
+int npendingFree = 0;
 
 
 // prototypes
 
-int getNewInode(void);
+static int dir_list( int dir, struct fs_inode *inode, fs_dirent_callback visit, void *arg );
 
 
-int fs_format()
+static void locks_init(void)
 {
-	if(fs_mounted == 1)
-	{
-		printf("Formatting Error: Can't format a mounted FS\n");
-		return 0;
-		
-	}
-	int blocks = disk_size();
-	int ninode_blocks = blocks / 10;
-	if(blocks < 3)
-	{
-		printf("Not enough blocks to build a file system!\n");
-		return 0;
-	}
-	if(ninode_blocks != 0){
-		if(blocks % ninode_blocks != 0)
-			ninode_blocks++; // Round up
-	}
-	else
-	{
-		ninode_blocks = 1;
-	}
-	union fs_block block;
-	disk_read(0,block.data);
+	int i;
+	for(i = 0; i < MAX_RESERVATIONS; i++)
+		pthread_mutex_init(&reservations[i].lock, NULL);
+	for(i = 0; i < MAX_STREAMS; i++)
+		pthread_mutex_init(&streams[i].lock, NULL);
+	for(i = 0; i < INODE_LOCKS; i++)
+		pthread_rwlock_init(&inodeLocks[i], NULL);
+
+	// Prefer the committer, or a steady stream of writers could starve it.
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&commitGate, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
 
-	// Format super
-	block.super.magic = FS_MAGIC;
-	block.super.nblocks = blocks;
-	block.super.ninodeblocks = ninode_blocks;
-	block.super.ninodes = ninode_blocks*INODES_PER_BLOCK;
+static void gate_enter(void)
+{
+	pthread_once(&locksOnce, locks_init);
+	pthread_rwlock_rdlock(&commitGate);
+}
 
-	disk_write(0,block.data);
+static void gate_leave(void)
+{
+	pthread_rwlock_unlock(&commitGate);
+}
 
-	// Invalidate all inodes
-	
-	int i;
-	int j;
-	union fs_block inode_block;
-	for(i = 0; i < ninode_blocks; i++)
+static void inode_rdlock( int inumber )
+{
+	pthread_once(&locksOnce, locks_init);
+	pthread_rwlock_rdlock(&inodeLocks[(unsigned)inumber % INODE_LOCKS]);
+}
+
+static void inode_wrlock( int inumber )
+{
+	pthread_once(&locksOnce, locks_init);
+	pthread_rwlock_wrlock(&inodeLocks[(unsigned)inumber % INODE_LOCKS]);
+}
+
+static void inode_unlock( int inumber )
+{
+	pthread_rwlock_unlock(&inodeLocks[(unsigned)inumber % INODE_LOCKS]);
+}
+
+// Inode blocks are loaded on first use; the first thread to get there
+// reads it and publishes it to the others. Returns NULL if there is no
+// memory to load it.
+static union fs_block *inode_block( int i )
+{
+	union fs_block *block = __atomic_load_n(&inodeTable[i], __ATOMIC_ACQUIRE);
+	if(!block)
 	{
-		disk_read(i+1, inode_block.data);
-		
-		for(j = 0; j < INODES_PER_BLOCK ; j++)
+		pthread_mutex_lock(&tableLock);
+		block = inodeTable[i];
+		if(!block)
 		{
-			inode_block.inode[j].isvalid = 0;
+			block = malloc(sizeof(union fs_block));
+			if(block)
+			{
+				cache_read(i+1, block->data);
+				__atomic_store_n(&inodeTable[i], block, __ATOMIC_RELEASE);
+			}
+			else
+			{
+				printf("Error Loading Inodes: Couldn't allocate inode block %d.\n", i+1);
+			}
 		}
-
-		disk_write(i+1,inode_block.data);
-
+		pthread_mutex_unlock(&tableLock);
 	}
+	return block;
+}
 
-	return 1;
+static _Bool fs_inline(void)
+{
+	return (superBlock.flags & FS_FORMAT_INLINE) != 0;
 }
 
-void fs_debug()
+static int inode_size(void)
 {
-	union fs_block block;
+	return fs_inline() ? INLINE_INODE_SIZE : sizeof(struct fs_inode);
+}
 
-	disk_read(0,block.data);
+static int inodes_per_block(void)
+{
+	return BYTES_PER_BLOCK / inode_size();
+}
 
-	printf("superblock:\n");
-	printf("\t%d blocks\n",block.super.nblocks);
-	printf("\t%d inode blocks\n",block.super.ninodeblocks);
-	printf("\t%d inodes\n",block.super.ninodes);
-	
-	int i;
-	int j;
-	int k;
-	union fs_block inode_blocks[block.super.ninodeblocks];
-	for(i = 1; i <= block.super.ninodeblocks; i++){ 
-		disk_read(i, inode_blocks[i-1].data);
-		for(j = 0; j < INODES_PER_BLOCK ; j++){
-			if(inode_blocks[i-1].inode[j].isvalid == 1){
-				printf("inode %d:\n",j+INODES_PER_BLOCK*(i-1));
-				int size = inode_blocks[i-1].inode[j].size;
-				printf("\tsize: %d bytes\n",size);
-				int nblocks = size/BYTES_PER_BLOCK;
-				if(size%BYTES_PER_BLOCK != 0)
-					nblocks += 1;
+// The j'th inode of an inode block.
+static struct fs_inode *block_inode( union fs_block *block, int j )
+{
+	return (struct fs_inode *)&block->data[j*inode_size()];
+}
 
-				int direct_blocks = ( nblocks > POINTERS_PER_INODE ? POINTERS_PER_INODE : nblocks);
-				int indirect_blocks = 0;
-				if(nblocks > POINTERS_PER_INODE)
-					indirect_blocks = nblocks - POINTERS_PER_INODE;
-				if(indirect_blocks > POINTERS_PER_BLOCK)
-				{
-					printf("Size exceeds FileSystem Capability\n");
-					return ;
-				}
-				printf("\tdirect blocks:");
-				for(k = 0; k < direct_blocks; k++)
-				{
-					printf(" %d",inode_blocks[i-1].inode[j].direct[k]);	
+static char *inline_data( struct fs_inode *inode )
+{
+	return (char *)inode + offsetof(struct fs_inode, direct);
+}
 
-				}
-				printf("\n");
+static struct fs_inode *inode_get( int inumber )
+{
+	union fs_block *block;
+	if(inumber < 0 || inumber >= superBlock.ninodes)
+		return NULL;
+	block = inode_block(inumber/inodes_per_block());
+	return (block ? block_inode(block, inumber%inodes_per_block()) : NULL);
+}
 
-				if( indirect_blocks > 0)
-				{
-					printf("\tindirect block: %d\n",inode_blocks[i-1].inode[j].indirect);
-					printf("\tindirect data blocks:");
-				
-					union fs_block pointers_block;
-					disk_read(inode_blocks[i-1].inode[j].indirect, pointers_block.data); 		
-					for(k = 0; k < indirect_blocks; k++)
-					{
-						printf(" %d",pointers_block.pointers[k]);
-						
-					}
-					printf("\n");
+static void inode_dirty( int inumber )
+{
+	__atomic_store_n(&inodeDirty[inumber/inodes_per_block()], 1, __ATOMIC_RELAXED);
+}
 
-				}
-			}
+static void inode_sync(void)
+{
+	int i;
+	for(i = 0; i < superBlock.ninodeblocks; i++)
+	{
+		if(inodeDirty[i])
+		{
+			cache_write(i+1, inodeTable[i]->data);
+			inodeDirty[i] = 0;
 		}
 	}
 }
 
-void print_bitmap(void)
+// Blocks needed to hold a bitmap of nbits bits.
+static int map_blocks( int nbits )
+{
+	return (nbits + BITS_PER_BLOCK - 1)/BITS_PER_BLOCK;
+}
+
+// The superblock, inode table, saved bitmaps and journal come before any data.
+static int first_data_block(void)
+{
+	return 1 + superBlock.ninodeblocks + superBlock.nbitmapblocks + superBlock.journalblocks;
+}
+
+static _Bool block_valid( int blockNum )
+{
+	return blockNum >= first_data_block() && blockNum < disk_size();
+}
+
+// Copy the i'th block's worth of bitmap b into block.
+static void map_image( struct bitmap *b, int i, union fs_block *block )
+{
+	int words = b->nwords - i*WORDS_PER_BLOCK;
+	if(words > WORDS_PER_BLOCK)
+		words = WORDS_PER_BLOCK;
+	memset(block->data, 0, BYTES_PER_BLOCK);
+	memcpy(block->words, &b->words[i*WORDS_PER_BLOCK], words*sizeof(uint64_t));
+}
+
+static void map_store( struct bitmap *b, int start )
 {
+	union fs_block block;
 	int i;
-	int nl = 0;
-	for(i = 0; i < bitmapSize; i++)
+	for(i = 0; i < map_blocks(b->nbits); i++)
 	{
-		printf("%d:%d,", i,bitmap[i]);
-		nl +=1;
-		if(nl > 10){
-			printf("\n");
-			nl = 0;
-		}
+		map_image(b, i, &block);
+		cache_write(start + i, block.data);
 	}
-	printf("\n");
-
 }
 
+static void map_load( struct bitmap *b, int start )
+{
+	union fs_block block;
+	int i;
+	for(i = 0; i < map_blocks(b->nbits); i++)
+	{
+		int words = b->nwords - i*WORDS_PER_BLOCK;
+		if(words > WORDS_PER_BLOCK)
+			words = WORDS_PER_BLOCK;
+		cache_read(start + i, block.data);
+		memcpy(&b->words[i*WORDS_PER_BLOCK], block.words, words*sizeof(uint64_t));
+	}
+	bitmap_refresh(b);
+}
 
-int fs_mount()
+// The superblock is written through the cache, so a cleared clean flag
+// is on disk before anything else changes.
+static void super_store(void)
 {
 	union fs_block block;
+	const char *bufs[1] = { block.data };
+	memset(block.data, 0, BYTES_PER_BLOCK);
+	block.super = superBlock;
+	cache_writev(0, 1, bufs);
+}
 
-	disk_read(0,block.data);
-	// Check Magic
-	if(block.super.magic != FS_MAGIC)
+// The magic changed with the 64-bit inode layout, and the version with
+// anything since that older code can't read.
+static int super_valid( struct fs_superblock *super )
+{
+	if(super->magic != FS_MAGIC)
 	{
 		printf("Did not find proper filesystem. Operation Failed\n");
 		return 0;
 	}
-	
-	if(bitmap != NULL)
+	if(super->version != FS_VERSION)
 	{
-		free(bitmap);
-		bitmap = NULL;
+		printf("The filesystem is version %d, but only version %d is supported. Operation Failed\n", super->version, FS_VERSION);
+		return 0;
 	}
-	bitmap = malloc((block.super.nblocks) * sizeof(_Bool));
-	
-	// Initialize bitmap to zero
-	
-	int b;
-	for(b = 0; b < block.super.nblocks; b++)
-	{
-		bitmap[b] = 0;
+	return 1;
+}
 
-	}
+static _Bool fs_extents(void)
+{
+	return (superBlock.flags & FS_FORMAT_EXTENTS) != 0;
+}
 
-	bitmap[0] = 1;
+static _Bool fs_journaled(void)
+{
+	return superBlock.journalblocks > 0;
+}
 
+static int journal_start(void)
+{
+	return 1 + superBlock.ninodeblocks + superBlock.nbitmapblocks;
+}
 
-	int diskSize = disk_size();
+// Blocks one transaction can hold: the journal less its header, the
+// descriptor and the commit block, and no more than a descriptor can name.
+static int journal_capacity(void)
+{
+	int n = superBlock.journalblocks - 3;
+	return n < JOURNAL_TAGS ? n : JOURNAL_TAGS;
+}
 
-	// Read used data blocks
-	int i;
-	int j;
-	int k;
-	
-	union fs_block inode_blocks[block.super.ninodeblocks];
-	for(i = 1; i <= block.super.ninodeblocks; i++){
-		bitmap[i] = 1;
-		disk_read(i, inode_blocks[i-1].data);
-		for(j = 0; j < INODES_PER_BLOCK ; j++){
-			if(inode_blocks[i-1].inode[j].isvalid == 1){
-				int size = inode_blocks[i-1].inode[j].size;
-				int nblocks = size/BYTES_PER_BLOCK;
-				if(size%BYTES_PER_BLOCK != 0)
-					nblocks += 1;
+// Pointer and extent blocks are written through here. With a journal they
+// stay pinned in the cache until the commit that logs them.
+static void meta_write( int blocknum, const char *data )
+{
+	if(fs_journaled())
+		cache_write_pinned(blocknum, data);
+	else
+		cache_write(blocknum, data);
+}
 
-				int direct_blocks = ( nblocks > POINTERS_PER_INODE ? POINTERS_PER_INODE : nblocks);
-				int indirect_blocks = 0;
-				if(nblocks > POINTERS_PER_INODE)
-					indirect_blocks = nblocks - POINTERS_PER_INODE;
-				if(indirect_blocks > POINTERS_PER_BLOCK)
-				{
-					printf("Error Mounting: A file with a too large size was detected.\n");
-					free(bitmap);
-					bitmap = NULL;
-					return 0;
-				}
-				for(k = 0; k < direct_blocks; k++)
-				{
-					int blockNum = inode_blocks[i-1].inode[j].direct[k];
-					if(blockNum <=block.super.ninodeblocks || blockNum >= diskSize )
-					{
-						printf("Error Mounting FS: Invalid block number detected in Filesystem.\n");
-						free(bitmap);
-						bitmap = NULL;
-						return 0;
-					}
-					bitmap[blockNum] = 1;		
-				}
+// Free count blocks of a deleted file, deferring it with a journal.
+static void blocks_free( int start, int count )
+{
+	if(fs_journaled())
+	{
+		bitmap_set_range(pendingFree, start, count);
+		__atomic_add_fetch(&npendingFree, count, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		bitmap_clear_range(bitmap, start, count);
+	}
+}
 
-				if( indirect_blocks > 0)
-				{
-					bitmap[inode_blocks[i-1].inode[j].indirect] = 1;
-					union fs_block pointers_block;
-					disk_read(inode_blocks[i-1].inode[j].indirect, pointers_block.data); 		
-					for(k = 0; k < indirect_blocks; k++)
-					{	
-						int blockNum = pointers_block.pointers[k];
-						if(blockNum <=block.super.ninodeblocks || blockNum >= diskSize )
-						{
-							printf("Error Mounting FS: Invalid block number detected in Filesystem.\n");
-							free(bitmap);
-							bitmap = NULL;
-							return 0;
-						}
-						bitmap[blockNum] = 1;
-						
-					}
+// Empty the journal: the next transaction goes first, numbered journalSeq.
+// needscan records that metadata is about to be written in place, so that
+// recovery cannot trust the home copies. The journal bypasses the cache.
+static void journal_header( int needscan )
+{
+	union fs_block block;
+	memset(block.data, 0, BYTES_PER_BLOCK);
+	block.journal.magic = JOURNAL_MAGIC;
+	block.journal.type = JOURNAL_HEADER;
+	block.journal.sequence = journalSeq;
+	block.journal.needscan = needscan;
+	disk_write(journal_start(), block.data);
+	disk_sync();
+	journalPos = 1;
+}
 
-				}
-			}
+// Write every logged block back to its home, then empty the journal.
+static void journal_checkpoint(void)
+{
+	cache_flush();
+	disk_sync();
+	journal_header(0);
+	memset(journaledBlocks->words, 0, journaledBlocks->nwords*sizeof(uint64_t));
+	bitmap_refresh(journaledBlocks);
+}
+
+// Once a commit has recorded the deletes, their blocks can be reused. If
+// one was logged as a pointer or extent block, empty the journal first so
+// that replaying the old copy cannot overwrite whatever reuses it.
+static void pending_release(void)
+{
+	int w, bit;
+
+	if(npendingFree == 0)
+		return;
+	for(w = 0; w < pendingFree->nwords; w++)
+	{
+		if(pendingFree->words[w] & journaledBlocks->words[w])
+		{
+			journal_checkpoint();
+			break;
 		}
 	}
-	fs_mounted = 1;	
-	bitmapSize = block.super.nblocks;
-	//print_bitmap();
-	return 1;
+	for(w = 0; w < pendingFree->nwords; w++)
+	{
+		uint64_t word = pendingFree->words[w];
+		while(word)
+		{
+			bit = __builtin_ctzll(word);
+			word &= word - 1;
+			bitmap_clear(bitmap, w*64 + bit);
+		}
+		pendingFree->words[w] = 0;
+	}
+	bitmap_refresh(pendingFree);
+	__atomic_store_n(&npendingFree, 0, __ATOMIC_RELAXED);
 }
 
-int fs_create()
+static void unpin_all( int *blocknums, int max )
 {
-	if(!fs_mounted)
+	int n, i;
+	while((n = cache_pinned(blocknums, max)) > 0)
 	{
-		printf("No mounted filesystem found\n");
+		for(i = 0; i < n && i < max; i++)
+			cache_unpin(blocknums[i]);
+	}
+}
+
+// The block bitmap as it should be after a crash: reservations do not
+// survive one and deferred frees are committed, so both are free in it.
+static struct bitmap *map_committed(void)
+{
+	struct bitmap *b = bitmap_create(bitmap->nbits);
+	int i;
+	if(!b)
+		return NULL;
+	for(i = 0; i < bitmap->nwords; i++)
+		b->words[i] = bitmap->words[i] & ~pendingFree->words[i];
+	for(i = 0; i < MAX_RESERVATIONS; i++)
+	{
+		pthread_mutex_lock(&reservations[i].lock);
+		if(reservations[i].length > 0)
+			bitmap_clear_range(b, reservations[i].start, reservations[i].length);
+		pthread_mutex_unlock(&reservations[i].lock);
+	}
+	bitmap_refresh(b);
+	return b;
+}
+
+// Add a block to the transaction being built, counting it even once it is full.
+static void journal_add( struct fs_journal *desc, union fs_block *copies, int max, int blocknum, const char *data )
+{
+	if(desc->count < max)
+	{
+		desc->blocknums[desc->count] = blocknum;
+		memcpy(copies[desc->count].data, data, BYTES_PER_BLOCK);
+	}
+	desc->count++;
+}
+
+// Log the metadata changed since the last commit as one transaction: the
+// pinned pointer and extent blocks, the dirty inode blocks and the bitmap
+// blocks that differ from their home copies. Once the commit block is on
+// disk the home copies are left in the cache to be written back, which
+// checkpoints them. A transaction too big for the journal is written in
+// place instead, with the header asking for a scan should that be cut short.
+// Returns 0, leaving everything pinned for the next try, if there is no
+// memory to build the transaction.
+static int journal_commit(void)
+{
+	int max = journal_capacity();
+	union fs_block *desc = malloc(sizeof(union fs_block));
+	union fs_block *copies = malloc((max > 0 ? max : 1) * sizeof(union fs_block));
+	const char **bufs = malloc((max + 1) * sizeof(char *));
+	struct bitmap *committed = map_committed();
+	union fs_block image, home;
+	int start = journal_start();
+	int i, n;
+
+	if(!desc || !copies || !bufs || !committed)
+	{
+		printf("Error Committing: Couldn't allocate the transaction.\n");
+		bitmap_delete(committed);
+		free(bufs);
+		free(copies);
+		free(desc);
 		return 0;
 	}
-	union fs_block super;
+	memset(desc->data, 0, BYTES_PER_BLOCK);
+	n = cache_pinned(desc->journal.blocknums, max);
+	for(i = 0; i < n && i < max; i++)
+	{
+		cache_read(desc->journal.blocknums[i], copies[i].data);
+		bitmap_set(journaledBlocks, desc->journal.blocknums[i]);
+	}
+	desc->journal.count = n;
 
-	union fs_block inodeB;
-	disk_read(0, super.data);
+	for(i = 0; i < superBlock.ninodeblocks; i++)
+	{
+		if(inodeDirty[i])
+			journal_add(&desc->journal, copies, max, i+1, inodeTable[i]->data);
+	}
 
-	int i;
-	int j;
-	int foundInode = -1;
-	_Bool found = 0;
-	for(i= 0; i < super.super.ninodeblocks;i++)
+	struct bitmap *maps[2] = { committed, inodeMap };
+	int mapstart = superBlock.ninodeblocks + 1;
+	int m;
+	for(m = 0; m < 2; m++)
 	{
-		disk_read(i+1, inodeB.data);
-		for(j = 0; j < INODES_PER_BLOCK; j++)
+		for(i = 0; i < map_blocks(maps[m]->nbits); i++)
 		{
-			if(!inodeB.inode[j].isvalid && j+i != 0)
-			{
-				found = 1;
-				foundInode = j;
-				break;
-			}
-
+			map_image(maps[m], i, &image);
+			cache_read(mapstart + i, home.data);
+			if(memcmp(image.data, home.data, BYTES_PER_BLOCK))
+				journal_add(&desc->journal, copies, max, mapstart + i, image.data);
 		}
-		if(found)
-			break;
+		mapstart += map_blocks(maps[m]->nbits);
 	}
-		
-		
-	// Create inode
-	if(found)
+
+	n = desc->journal.count;
+	if(n > max)
 	{
-		inodeB.inode[foundInode].isvalid = 1;
-		inodeB.inode[foundInode].size = 0;
-		disk_write(i+1, inodeB.data);
-		return foundInode + i*INODES_PER_BLOCK;
+		journal_checkpoint();
+		journal_header(1);
+		inode_sync();
+		map_store(committed, superBlock.ninodeblocks + 1);
+		map_store(inodeMap, superBlock.ninodeblocks + 1 + map_blocks(superBlock.nblocks));
+		unpin_all(desc->journal.blocknums, JOURNAL_TAGS);
+		journal_checkpoint();
 	}
-	else
+	else if(n > 0)
 	{
-		return 0;
+		if(journalPos + n + 2 > superBlock.journalblocks)
+			journal_checkpoint();
+
+		desc->journal.magic = JOURNAL_MAGIC;
+		desc->journal.type = JOURNAL_DESCRIPTOR;
+		desc->journal.sequence = journalSeq;
+		bufs[0] = desc->data;
+		for(i = 0; i < n; i++)
+			bufs[i+1] = copies[i].data;
+		disk_writev(start + journalPos, n + 1, bufs);
+		disk_sync();
+
+		memset(home.data, 0, BYTES_PER_BLOCK);
+		home.journal.magic = JOURNAL_MAGIC;
+		home.journal.type = JOURNAL_COMMIT;
+		home.journal.sequence = journalSeq;
+		home.journal.count = n;
+		disk_write(start + journalPos + n + 1, home.data);
+		disk_sync();
+		journalPos += n + 2;
+		journalSeq++;
+
+		for(i = 0; i < n; i++)
+		{
+			cache_write(desc->journal.blocknums[i], copies[i].data);
+			cache_unpin(desc->journal.blocknums[i]);
+		}
+		for(i = 0; i < superBlock.ninodeblocks; i++)
+			inodeDirty[i] = 0;
 	}
+
+	pending_release();
+	bitmap_delete(committed);
+	free(bufs);
+	free(copies);
+	free(desc);
+	return 1;
 }
 
-int fs_delete( int inumber )
+// Copy each complete transaction in the journal to its home blocks, in
+// order, and return how many there were. *needscan is set if the metadata
+// on disk cannot be trusted and the inodes must be scanned.
+static int journal_replay( int *needscan )
 {
-	if(!fs_mounted)
+	union fs_block header, desc, commit, copy;
+	int start = journal_start();
+	int pos = 1;
+	int n = 0;
+	int i;
+
+	disk_read(start, header.data);
+	if(header.journal.magic != JOURNAL_MAGIC || header.journal.type != JOURNAL_HEADER)
 	{
-		printf("No mounted filesystem found\n");
+		*needscan = 1;
+		journalSeq = 1;
 		return 0;
 	}
-	union fs_block super;
-
-	union fs_block inodeB;
-	disk_read(0, super.data);
+	journalSeq = header.journal.sequence;
+	*needscan = header.journal.needscan;
 
-	int inodeBlock = inumber/INODES_PER_BLOCK;
-	if(inodeBlock > super.super.ninodeblocks || inumber > super.super.ninodes || inumber < 1){
-		printf("Invalid inumber\n");
-		return 0;
-	}
-	
-	_Bool Error = 0;
-	disk_read(inodeBlock + 1, inodeB.data);
-
-	int inodeIndex = inumber - INODES_PER_BLOCK*inodeBlock;
-	if(inodeB.inode[inodeIndex].isvalid)
-	{	
-		int k;
-		int size = inodeB.inode[inodeIndex].size;
-		int diskSize = disk_size();
-		int nblocks = size/BYTES_PER_BLOCK;
-		if(size%BYTES_PER_BLOCK != 0)
-			nblocks += 1;
-
-		int direct_blocks = ( nblocks > POINTERS_PER_INODE ? POINTERS_PER_INODE : nblocks);
-		int indirect_blocks = 0;
-		if(nblocks > POINTERS_PER_INODE)
-			indirect_blocks = nblocks - POINTERS_PER_INODE;
-		if(indirect_blocks > POINTERS_PER_BLOCK)
-		{
-			printf("Error Deleting Inode: A file with a too large size was detected.Possible corruption in filesystem. An attempt to fix the corruption will be made.\n");
-			indirect_blocks = POINTERS_PER_BLOCK;
-			Error = 1;
-		}
-		for(k = 0; k < direct_blocks; k++)
+	while(pos + 2 <= superBlock.journalblocks)
+	{
+		disk_read(start + pos, desc.data);
+		int count = desc.journal.count;
+		if(desc.journal.magic != JOURNAL_MAGIC || desc.journal.type != JOURNAL_DESCRIPTOR || desc.journal.sequence != journalSeq)
+			break;
+		if(count < 1 || count > JOURNAL_TAGS || pos + count + 2 > superBlock.journalblocks)
+			break;
+		disk_read(start + pos + count + 1, commit.data);
+		if(commit.journal.magic != JOURNAL_MAGIC || commit.journal.type != JOURNAL_COMMIT || commit.journal.sequence != journalSeq || commit.journal.count != count)
+			break;
+
+		for(i = 0; i < count; i++)
 		{
-			int blockNum = inodeB.inode[inodeIndex].direct[k];
-			if(blockNum <=super.super.ninodeblocks || blockNum >= diskSize )
+			int blocknum = desc.journal.blocknums[i];
+			if(blocknum < 1 || blocknum >= superBlock.nblocks || (blocknum >= start && blocknum < start + superBlock.journalblocks))
 			{
-				printf("Error Deleting: Invalid block number detected in Filesystem.\n");
-				Error = 1;
-			}
-			else{
-				bitmap[blockNum] = 0;
+				*needscan = 1;
+				continue;
 			}
+			disk_read(start + pos + 1 + i, copy.data);
+			cache_write(blocknum, copy.data);
 		}
+		pos += count + 2;
+		journalSeq++;
+		n++;
+	}
+	cache_flush();
+	disk_sync();
+	return n;
+}
 
-		if( indirect_blocks > 0)
-		{
-		
-			union fs_block pointers_block;
-			disk_read(inodeB.inode[inodeIndex].indirect, pointers_block.data); 		
-			for(k = 0; k < indirect_blocks; k++)
-			{	
-				int blockNum = pointers_block.pointers[k];
-				if(blockNum <=super.super.ninodeblocks || blockNum >= diskSize )
-				{
-					printf("Error Deleting Inode: Invalid block number detected in Filesystem.\n");
-					Error = 1;
-				}
-				else{
-					bitmap[blockNum] = 0;
-				}
-				
-			}
-			bitmap[inodeB.inode[inodeIndex].indirect] = 0; // free indirect block
-		}
+// Extent blocks needed to hold a list of n extents.
+static int extent_blocks( int n )
+{
+	if(n <= EXTENTS_PER_INODE)
+		return 0;
+	return (n - EXTENTS_PER_INODE + EXTENTS_PER_BLOCK - 1)/EXTENTS_PER_BLOCK;
+}
 
+// An extent list big enough for any file, with room for extents_replace to
+// grow it past the limit before refusing.
+static struct fs_extent *extents_alloc(void)
+{
+	struct fs_extent *ext = malloc((MAX_EXTENTS + 3)*sizeof(struct fs_extent));
+	if(!ext)
+		printf("Extent Error: Couldn't allocate an extent list.\n");
+	return ext;
+}
 
-	}
-	else{
-		printf("Error Deleting Inode: The inode is invalid\n");
-		return 0;
+// Store the numbers of the extent blocks of an inode in chain[], reading
+// each with readblock. Returns how many there are, or -1 if the chain is
+// corrupt.
+static int extents_chain_with( struct fs_inode *inode, int *chain, void (*readblock)( int blocknum, char *data ) )
+{
+	union fs_block block;
+	int blocknum = inode->extentblock;
+	int k = 0;
 
-	}
-	// Write to inode
-	inodeB.inode[inodeIndex].size = 0;
-	inodeB.inode[inodeIndex].isvalid = 0;
-	disk_write(inodeBlock + 1, inodeB.data);
-	if(Error)
+	while(blocknum)
 	{
-		printf("Inode was succesfully deleted, but there may be some corruption in data\n");
+		if(k == MAX_EXTENT_BLOCKS || !block_valid(blocknum))
+			return -1;
+		chain[k++] = blocknum;
+		readblock(blocknum, block.data);
+		blocknum = block.extents.next;
 	}
-	return 1;
+	return k;
 }
 
-int fs_getsize( int inumber )
+// Copy the extent list of an inode into ext[], reading the extent blocks
+// with readblock. Returns the number of extents, or -1 if the list is corrupt.
+static int extents_load_with( struct fs_inode *inode, struct fs_extent *ext, void (*readblock)( int blocknum, char *data ) )
 {
-	if(!fs_mounted)
-	{
-		printf("GetSize Error: No mounted filesystem found\n");
+	union fs_block block;
+	int n = inode->nextents;
+	int blocknum = inode->extentblock;
+	int i, k;
+	if(n < 0 || n > MAX_EXTENTS)
 		return -1;
+
+	memcpy(ext, inode->extent, (n < EXTENTS_PER_INODE ? n : EXTENTS_PER_INODE)*sizeof(struct fs_extent));
+	for(i = EXTENTS_PER_INODE; i < n; i += k)
+	{
+		if(!block_valid(blocknum))
+			return -1;
+		readblock(blocknum, block.data);
+		k = (n - i < EXTENTS_PER_BLOCK ? n - i : EXTENTS_PER_BLOCK);
+		memcpy(&ext[i], block.extents.extent, k*sizeof(struct fs_extent));
+		blocknum = block.extents.next;
 	}
-	union fs_block super;
 
-	union fs_block inodeB;
-	disk_read(0, super.data);
+	for(i = 0; i < n; i++)
+	{
+		if(ext[i].length < 1 || (ext[i].start && (!block_valid(ext[i].start) || !block_valid(ext[i].start + ext[i].length - 1))))
+			return -1;
+	}
+	return n;
+}
 
-	int inodeBlock = inumber/INODES_PER_BLOCK;
-	if(inodeBlock > super.super.ninodeblocks || inumber > super.super.ninodes || inumber < 1){
-		printf("GetSize Error: Invalid inumber\n");
-		return -1;
+static int extents_load( struct fs_inode *inode, struct fs_extent *ext )
+{
+	return extents_load_with(inode, ext, cache_read);
+}
+
+// The extent blocks have to be allocated already if the list needs them.
+// Ones no longer needed are freed, and ones left unchanged not rewritten.
+static void extents_store( int inumber, struct fs_inode *inode, struct fs_extent *ext, int n )
+{
+	int chain[MAX_EXTENT_BLOCKS];
+	int nblocks = extent_blocks(n);
+	int k = extents_chain_with(inode, chain, cache_read);
+	int i;
+
+	if(k < nblocks)
+	{
+		printf("Error Writing: Invalid extent block chain detected in Filesystem.\n");
+		return;
 	}
-	
-	disk_read(inodeBlock + 1, inodeB.data);
+	memcpy(inode->extent, ext, (n < EXTENTS_PER_INODE ? n : EXTENTS_PER_INODE)*sizeof(struct fs_extent));
+	for(i = 0; i < nblocks; i++)
+	{
+		union fs_block block, old;
+		int first = EXTENTS_PER_INODE + i*EXTENTS_PER_BLOCK;
+		int count = (n - first < EXTENTS_PER_BLOCK ? n - first : EXTENTS_PER_BLOCK);
+		memset(block.data, 0, BYTES_PER_BLOCK);
+		block.extents.next = (i + 1 < nblocks ? chain[i+1] : 0);
+		memcpy(block.extents.extent, &ext[first], count*sizeof(struct fs_extent));
+		cache_read(chain[i], old.data);
+		if(memcmp(block.data, old.data, BYTES_PER_BLOCK))
+			meta_write(chain[i], block.data);
+	}
+	for(; i < k; i++)
+		blocks_free(chain[i], 1);
+	if(nblocks == 0)
+		inode->extentblock = 0;
+	inode->nextents = n;
+	inode_dirty(inumber);
+}
 
-	int inodeIndex = inumber - INODES_PER_BLOCK*inodeBlock;
-	if(inodeB.inode[inodeIndex].isvalid)
+// Physical block of logical block l, or 0 for a hole.
+static int extents_lookup( struct fs_extent *ext, int n, int l )
+{
+	int i;
+	for(i = 0; i < n; l -= ext[i].length, i++)
 	{
-		return inodeB.inode[inodeIndex].size;
+		if(l < ext[i].length)
+			return ext[i].start ? ext[i].start + l : 0;
 	}
+	return 0;
+}
+
+// Append a run to out, merging it into the last extent when it continues it.
+static void extents_push( struct fs_extent *out, int *m, int start, int length )
+{
+	struct fs_extent *last = (*m > 0 ? &out[*m - 1] : NULL);
+	if(length <= 0)
+		return;
+	if(last && (start ? last->start && last->start + last->length == start : !last->start))
+		last->length += length;
 	else
 	{
-		printf("GetSize Error: Invalid Inode\n");
-		return -1;
+		out[*m].start = start;
+		out[*m].length = length;
+		(*m)++;
 	}
-	
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
+// Append the runs mapping logical blocks from..to-1 to out.
+static void extents_slice( struct fs_extent *ext, int n, int from, int to, struct fs_extent *out, int *m )
 {
-	if(!fs_mounted)
+	int pos = 0;
+	int i;
+	for(i = 0; i < n && pos < to; pos += ext[i].length, i++)
 	{
-		printf("No mounted filesystem found\n");
-		return 0;
+		int a = (from > pos ? from : pos);
+		int b = (to < pos + ext[i].length ? to : pos + ext[i].length);
+		if(a < b)
+			extents_push(out, m, ext[i].start ? ext[i].start + (a - pos) : 0, b - a);
 	}
-	union fs_block super;
-	int read = 0; // Bytes read
+	if(from > pos)
+		pos = from;
+	if(to > pos)
+		extents_push(out, m, 0, to - pos);
+}
 
-	union fs_block inodeB;
-	disk_read(0, super.data);
+// Map logical blocks l..l+count-1 to the physical run from start, or to a
+// hole if start is 0. Holes past the last extent are left implicit.
+// Returns 0, leaving ext alone, if that would take more than MAX_EXTENTS.
+// The new list is built in out, a scratch list from extents_alloc().
+static int extents_replace( struct fs_extent *ext, int *n, int l, int count, int start, struct fs_extent *out )
+{
+	int m = 0;
+	int end = 0;
+	int i;
 
-	int inodeBlock = inumber/INODES_PER_BLOCK;
-	if(inodeBlock > super.super.ninodeblocks || inumber > super.super.ninodes || inumber < 1){
-		printf("Read Error: Invalid inumber\n");
-		return 0;
+	for(i = 0; i < *n; i++)
+		end += ext[i].length;
+	extents_slice(ext, *n, 0, l, out, &m);
+	extents_push(out, &m, start, count);
+	extents_slice(ext, *n, l + count, end, out, &m);
+	while(m > 0 && !out[m-1].start)
+		m--;
+	if(m <= MAX_EXTENTS)
+	{
+		memcpy(ext, out, m*sizeof(struct fs_extent));
+		*n = m;
 	}
-	
-	disk_read(inodeBlock + 1, inodeB.data);
+	return m <= MAX_EXTENTS;
+}
 
-	int inodeIndex = inumber - INODES_PER_BLOCK*inodeBlock;
-	if(inodeB.inode[inodeIndex].isvalid)
-	{	
-		int size = inodeB.inode[inodeIndex].size;
-		
-		if(length + offset > size)
-		{
-			length = size - offset;
-		}
-		
-		if(offset > size)
-		{
-			return 0;
-		}
+// Free every block of an extent-mapped inode, one extent at a time.
+// Returns 0 if the extent list is corrupt, or -1, freeing nothing, if
+// there is no memory to load it in.
+static int extents_release( struct fs_inode *inode )
+{
+	struct fs_extent *ext = extents_alloc();
+	int chain[MAX_EXTENT_BLOCKS];
+	int n;
+	int k;
+	int i;
 
-		
-		int diskSize = disk_size();
-		int k;
-		int nblocks = size/BYTES_PER_BLOCK;
-		int startDirectByte = 0;
-		int startIndirectByte = 0;
-		int startDirectBlock;
-		int startIndirectBlock;
-		if(size%BYTES_PER_BLOCK != 0)
-			nblocks += 1;
-	
-		startDirectByte = offset%BYTES_PER_BLOCK;
-		startIndirectByte = (offset-(BYTES_PER_BLOCK*POINTERS_PER_INODE))%BYTES_PER_BLOCK;
-		if(startIndirectByte < 0)
-			startIndirectByte = 0;
+	if(!ext)
+		return -1;
+	n = extents_load(inode, ext);
+	k = extents_chain_with(inode, chain, cache_read);
+	for(i = 0; i < n; i++)
+	{
+		if(ext[i].start)
+			blocks_free(ext[i].start, ext[i].length);
+	}
+	for(i = 0; i < k; i++)
+		blocks_free(chain[i], 1);
+	free(ext);
+	return n >= 0 && k >= 0;
+}
 
-		
-		startDirectBlock = offset/BYTES_PER_BLOCK;
-		startIndirectBlock = (offset - (BYTES_PER_BLOCK*POINTERS_PER_INODE))/BYTES_PER_BLOCK;
-		if(startIndirectBlock < 0)
-			startIndirectBlock = 0;
+// Number of blocks needed to hold size bytes.
+static int64_t size_blocks( int64_t size )
+{
+	return (size + BYTES_PER_BLOCK - 1)/BYTES_PER_BLOCK;
+}
 
+// Logical blocks an inode may map: a compressed file stored as is maps its
+// last chunk whole, even past the end of the file.
+static int64_t inode_blocks( struct fs_inode *inode )
+{
+	int64_t nblocks = size_blocks(inode->size);
+	if(inode->flags & INODE_COMPRESSED)
+		nblocks = (nblocks + CHUNK_BLOCKS - 1)/CHUNK_BLOCKS*CHUNK_BLOCKS;
+	return nblocks;
+}
 
+// Largest size a file can grow to.
+static int64_t inode_max_size( struct fs_inode *inode )
+{
+	if(inode->flags & INODE_COMPRESSED)
+		return (int64_t)CHUNK_BYTES*MAX_CHUNKS;
+	return (int64_t)BYTES_PER_BLOCK*MAX_FILE_BLOCKS;
+}
 
-		int direct_blocks = ( nblocks > POINTERS_PER_INODE ? POINTERS_PER_INODE : nblocks);
-		int indirect_blocks = 0;
-		int to_read = 0;
-		if(nblocks > POINTERS_PER_INODE)
-			indirect_blocks = nblocks - POINTERS_PER_INODE;
-		if(indirect_blocks > POINTERS_PER_BLOCK)
-		{
-			printf("Error Reading Inode: A file with a too large size was detected.Possible corruption in filesystem. An attempt to read will be made.\n");
-			indirect_blocks = POINTERS_PER_BLOCK;
-		}
-		//printf("startDirectBlock:%d\nstartIndirectBlock:%d\ndirect_blocks:%d\nindirect_blocks:%d\nlength:%d\noffset:%d\nsize:%d\n",startDirectBlock, startIndirectBlock, direct_blocks, indirect_blocks, length, offset, size);
-		for(k = startDirectBlock; k < direct_blocks && read < length; k++)
-		{
-			union fs_block readBlock;
-			int blockNum = inodeB.inode[inodeIndex].direct[k];
-			// printf("Reading block %d\n",blockNum);
-			if(blockNum <=super.super.ninodeblocks || blockNum >= diskSize )
-			{
-				printf("Error Reading: Invalid block number detected in Filesystem.\n");
-				return read;
-			}
-			else{
-				if(startDirectByte > 0)
-				{
-					memmove(readBlock.data, &readBlock.data[startDirectByte], BYTES_PER_BLOCK-startDirectByte);
-					to_read = ((length-read) > BYTES_PER_BLOCK - startDirectByte) ? (BYTES_PER_BLOCK-startDirectByte) : length-read;
-					startDirectByte = 0;
-				}
-				else
-				{
-					to_read = ((length - read) > BYTES_PER_BLOCK) ? BYTES_PER_BLOCK : length-read;
-				}
-		//		printf("to_read is: %d\nread is:%d\nlength is:%d\n",to_read, read, length);
-		//		printf("disk_read segfaults\n");
-				disk_read(blockNum, readBlock.data);
-		//		printf("strncat segfaults\n");
-				memcpy(&data[read], readBlock.data, to_read);
-		//		printf("It doesn't\n");
-				read += to_read;
-			}
-		}
+// Data blocks covered by one pointer at the given depth of an indirect tree.
+static int64_t tree_span( int depth )
+{
+	int64_t span = 1;
+	while(--depth > 0)
+		span *= POINTERS_PER_BLOCK;
+	return span;
+}
 
-		if( indirect_blocks > 0)
-		{
-		//	printf("reading indirect\n");
-		//	printf("startDirectBlock:%d\nstartIndirectBlock:%d\ndirect_blocks:%d\nindirect_blocks:%d\nlength:%d\noffset:%d\nsize:%d\nread:%d\n",startDirectBlock, startIndirectBlock, direct_blocks, indirect_blocks, length, offset, size, read);
-			union fs_block readBlock;	
-			union fs_block pointers_block;
-			disk_read(inodeB.inode[inodeIndex].indirect, pointers_block.data); 		
-			for(k = startIndirectBlock; k < indirect_blocks && read < length; k++)
-			{	
-				int blockNum = pointers_block.pointers[k];
-				//printf("Reading block %d\n",blockNum);
-				if(blockNum <=super.super.ninodeblocks || blockNum >= diskSize )
-				{
-					printf("Error Reading: Invalid block number detected in Filesystem.\n");
-					return read;
-				}
-				else{
-					if(startIndirectByte > 0)
-					{
-						memmove(readBlock.data, &readBlock.data[startIndirectByte], BYTES_PER_BLOCK-startIndirectByte);
-						to_read = ((length-read) > BYTES_PER_BLOCK - startIndirectByte) ? (BYTES_PER_BLOCK-startIndirectByte) : length-read;
-						startIndirectByte = 0;
-					}
-					else
-					{
-						to_read = ((length - read) > BYTES_PER_BLOCK) ? BYTES_PER_BLOCK : length-read;
-					}
-					disk_read(blockNum, readBlock.data);
-					memcpy(&data[read], readBlock.data, to_read);
-					read += to_read;
-				}
-				
-			}
-		}
+// Visit the pointer block blocknum and the first nblocks data blocks under
+// it, depth levels down. Zero pointers are holes. Invalid block numbers are
+// skipped, not followed. Returns 0 if any were found.
+static int tree_walk( int blocknum, int depth, int64_t nblocks, void (*readblock)( int blocknum, char *data ), void (*visit)( void *arg, int blocknum, int meta ), void *arg )
+{
+	union fs_block block;
+	int64_t span = tree_span(depth);
+	int ok = 1;
+	int i;
 
-	}
-	else{
-		printf("Error Reading: The inode is invalid\n");
+	if(blocknum == 0)
+		return 1;
+	if(!block_valid(blocknum))
 		return 0;
-
+	visit(arg, blocknum, 1);
+	readblock(blocknum, block.data);
+	for(i = 0; i < POINTERS_PER_BLOCK && i*span < nblocks; i++)
+	{
+		int64_t n = nblocks - i*span;
+		if(n > span)
+			n = span;
+		if(depth > 1)
+			ok &= tree_walk(block.pointers[i], depth-1, n, readblock, visit, arg);
+		else if(block.pointers[i] == 0)
+			continue;
+		else if(!block_valid(block.pointers[i]))
+			ok = 0;
+		else
+			visit(arg, block.pointers[i], 0);
 	}
-	return read;
+	return ok;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
+// Visit every block owned by a block pointer inode: data blocks with meta
+// 0 and pointer blocks with meta 1. Returns 0 if the inode is corrupt.
+static int pointers_walk( struct fs_inode *inode, void (*readblock)( int blocknum, char *data ), void (*visit)( void *arg, int blocknum, int meta ), void *arg )
 {
-	// Check Mounted
-	if(!fs_mounted)
+	int roots[INDIRECT_LEVELS] = { inode->indirect, inode->dindirect, inode->tindirect };
+	int64_t nblocks = inode_blocks(inode);
+	int ok = 1;
+	int k;
+
+	if(inode->size < 0 || nblocks > MAX_FILE_BLOCKS)
 	{
-		printf("No mounted filesystem found\n");
-		return 0;
+		nblocks = MAX_FILE_BLOCKS;
+		ok = 0;
 	}
-
-
-	// Check Inumber
-	union fs_block super;
-	int size;
-	union fs_block inodeB;
-	disk_read(0, super.data);
-	
-	int inodeBlock = inumber/INODES_PER_BLOCK;
-	if(inodeBlock > super.super.ninodeblocks || inumber > super.super.ninodes || inumber < 1){
-		printf("Write Error: Invalid inumber\n");
-		return 0;
+	for(k = 0; k < POINTERS_PER_INODE && k < nblocks; k++)
+	{
+		if(inode->direct[k] == 0)
+			continue;
+		if(!block_valid(inode->direct[k]))
+			ok = 0;
+		else
+			visit(arg, inode->direct[k], 0);
 	}
-	
-	// Read Inode
-	disk_read(inodeBlock + 1, inodeB.data);
-	int written = 0;
-
-	int inodeIndex = inumber - INODES_PER_BLOCK*inodeBlock;
-	if(inodeB.inode[inodeIndex].isvalid)
-	{	
-		// Find size and test offset
-		size = inodeB.inode[inodeIndex].size;
-	
+	nblocks -= k;
+	for(k = 0; k < INDIRECT_LEVELS && nblocks > 0; k++)
+	{
+		int64_t n = tree_span(k+2);
+		if(n > nblocks)
+			n = nblocks;
+		ok &= tree_walk(roots[k], k+1, n, readblock, visit, arg);
+		nblocks -= n;
+	}
+	return ok;
+}
 
-		// Find starting bytes and blocks
-		int diskSize = disk_size();
-		int k;
-		int nblocks = size/BYTES_PER_BLOCK;
-		int startDirectByte = 0;
-		int startIndirectByte = 0;
-		int startDirectBlock;
-		int startIndirectBlock;
-		_Bool allocateIndirectBlock = 0;
-		if(size%BYTES_PER_BLOCK != 0)
-			nblocks += 1;
-	
-		startDirectByte = offset%BYTES_PER_BLOCK;
-		startIndirectByte = (offset-(BYTES_PER_BLOCK*POINTERS_PER_INODE))%BYTES_PER_BLOCK;
-		if(startIndirectByte < 0)
-			startIndirectByte = 0;
-		
-		startDirectBlock = offset/BYTES_PER_BLOCK;
-		startIndirectBlock = (offset - (BYTES_PER_BLOCK*POINTERS_PER_INODE))/BYTES_PER_BLOCK;
-		if(startIndirectBlock < 0)
-			startIndirectBlock = 0;
+static void reservation_drop( struct reservation *r )
+{
+	if(r->length > 0)
+		bitmap_clear_range(bitmap, r->start, r->length);
+	r->inumber = 0;
+	r->length = 0;
+}
 
+static void reservation_drop_inode( int inumber )
+{
+	struct reservation *r = &reservations[inumber % MAX_RESERVATIONS];
+	pthread_mutex_lock(&r->lock);
+	if(r->inumber == inumber)
+		reservation_drop(r);
+	pthread_mutex_unlock(&r->lock);
+}
 
-		
-		// Find blocks to allocate
-		int bytesToAllocate = ((offset + length) - nblocks*BYTES_PER_BLOCK);
-		
-		int blocksToAllocate = bytesToAllocate/BYTES_PER_BLOCK;
-		if(bytesToAllocate % BYTES_PER_BLOCK != 0)
-			blocksToAllocate += 1;
-		int directAllocateIndex = POINTERS_PER_INODE - 1;
-		int indirectAllocateIndex = -1;
-		if(nblocks >= POINTERS_PER_INODE)
-		{
-			indirectAllocateIndex = nblocks - POINTERS_PER_INODE - 1;
-		}
-		else
-		{
-			directAllocateIndex = nblocks -1;
-		}
-		int onblocks = nblocks;
-		nblocks += blocksToAllocate;
-		
-		if(onblocks <= POINTERS_PER_INODE && nblocks > POINTERS_PER_INODE)
-		{	
-			allocateIndirectBlock = 1;
-		}
-		if(offset > BYTES_PER_BLOCK*onblocks)
-		{
-			offset = BYTES_PER_BLOCK*onblocks;
-		}
+static void reservation_drop_all(void)
+{
+	int i;
+	for(i = 0; i < MAX_RESERVATIONS; i++)
+	{
+		pthread_mutex_lock(&reservations[i].lock);
+		reservation_drop(&reservations[i]);
+		pthread_mutex_unlock(&reservations[i].lock);
+	}
+}
 
-		// Find blocks to load
-		int direct_blocks = ( nblocks > POINTERS_PER_INODE ? POINTERS_PER_INODE : nblocks);
-		int indirect_blocks = 0;
-		
-		int to_write = 0;
-		if(nblocks > POINTERS_PER_INODE)
-			indirect_blocks = nblocks - POINTERS_PER_INODE;
-		if(indirect_blocks > POINTERS_PER_BLOCK)
-		{
-			printf("Error Reading Inode: A file with a too large size was detected.Possible corruption in filesystem. An attempt to write will be made.\n");
-			indirect_blocks = POINTERS_PER_BLOCK;
-		}
+// Allocate a data block for inumber, ideally goal (the block after the
+// file's current last block). Takes the next block of the file's
+// reservation if it follows on, otherwise reserves a new contiguous run
+// sized to the rest of the write or the preallocation window.
+static int alloc_block( int inumber, int goal, int want )
+{
+	struct reservation *r = &reservations[inumber % MAX_RESERVATIONS];
+	int start;
+	int got;
 
-		
-		_Bool changedInodeBlock = 0;
-		_Bool changedPointersBlock = 0;
-		_Bool ranOutOfMemory = 0;
-		int blockNum;
-		for(k = startDirectBlock; k < direct_blocks && written < length; k++)
-		{
-			union fs_block writeBlock;
-			if(k > directAllocateIndex){
+	pthread_mutex_lock(&r->lock);
+	if(r->inumber == inumber && r->length > 0 && (goal == 0 || r->start == goal))
+	{
+		r->length--;
+		start = r->start++;
+		pthread_mutex_unlock(&r->lock);
+		return start;
+	}
 
-				blockNum = getNewInode();
-				if(blockNum < 0)
-				{
-					ranOutOfMemory = 1;
-					printf("System has run out of memory. Please delete some files to free memory\n");
-				}
-				else{
-					inodeB.inode[inodeIndex].direct[k] = blockNum;
-					changedInodeBlock = 1;
-				}
-			}
-			else
-			{
-				blockNum = inodeB.inode[inodeIndex].direct[k];
-			}
-			if(blockNum <=super.super.ninodeblocks || blockNum >= diskSize)
-			{
-				if(!ranOutOfMemory)
-					printf("Error Writing: Invalid block number detected in Filesystem.\n");
-			}
-			else{
-				if(startDirectByte > 0)
-				{
-					to_write = ((length-written) > BYTES_PER_BLOCK - startDirectByte) ? (BYTES_PER_BLOCK-startDirectByte) : length-written;
-					memcpy(&writeBlock.data[startDirectByte], &data[written], to_write); // written should always be 0 at this point
-					startDirectByte = 0;
-				}
-				else
-				{
-					to_write = ((length - written) > BYTES_PER_BLOCK) ? BYTES_PER_BLOCK : length-written;
-					memcpy(writeBlock.data, &data[written],to_write); 	
-				}
-				//printf("writeBlock data: %s\n", writeBlock.data);
-				disk_write(blockNum, writeBlock.data);
-				written += to_write;
-			}
-		}
+	reservation_drop(r);
+	start = bitmap_alloc_run(bitmap, goal, want > preallocBlocks ? want : preallocBlocks, &got);
+	if(start >= 0)
+	{
+		r->inumber = inumber;
+		r->start = start + 1;
+		r->length = got - 1;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return start;
+}
 
-		if(changedInodeBlock)
-			disk_write(inodeBlock + 1, inodeB.data);
+static void stream_drop( int inumber )
+{
+	struct stream *s = &streams[inumber % MAX_STREAMS];
+	pthread_mutex_lock(&s->lock);
+	if(s->inumber == inumber)
+		s->inumber = 0;
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Free the data blocks of logical blocks from..to-1 under the pointer block
+// in *slot, the root of a depth-level tree whose first block is base.
+// A pointer block left pointing at nothing is freed and *slot cleared.
+// Returns 1 if *slot changed.
+static int tree_release( int *slot, int depth, int64_t base, int64_t from, int64_t to )
+{
+	union fs_block block;
+	int64_t span = tree_span(depth);
+	_Bool changed = 0;
+	_Bool empty = 1;
+	int i;
 
-		if( indirect_blocks > 0 && !ranOutOfMemory)
+	if(!block_valid(*slot) || to <= base || from >= base + span*POINTERS_PER_BLOCK)
+		return 0;
+	cache_read(*slot, block.data);
+	for(i = 0; i < POINTERS_PER_BLOCK; i++)
+	{
+		int64_t start = base + i*span;
+		if(block.pointers[i] && start < to && start + span > from)
 		{
-			union fs_block writeBlock;	
-			union fs_block pointers_block;
-			if(allocateIndirectBlock){
-				int newInode = getNewInode();
-				if(newInode < 0)
-				{
-					ranOutOfMemory = 1;
-					printf("System has ran out of memory\n");
-				}
-				else
-				{
-					inodeB.inode[inodeIndex].indirect = newInode; // Will be written to disk later along size
-					//printf("Allocating new indirect block:%d\n",inodeB.inode[inodeIndex].indirect);
-				}
-			}
-			disk_read(inodeB.inode[inodeIndex].indirect, pointers_block.data); 		
-			int blockNum;
-			for(k = startIndirectBlock; k < indirect_blocks && written < length && !ranOutOfMemory; k++)
-			{	
-				if(k > indirectAllocateIndex){
-
-					blockNum = getNewInode();
-					if(blockNum < 0)
-					{
-						printf("System ran out of memory\n");
-						ranOutOfMemory = 1;
-						break;
-					}
-					pointers_block.pointers[k] = blockNum;
-					changedPointersBlock = 1;
-				}
-				else
-				{
-					blockNum = pointers_block.pointers[k];
-				}
-				int blockNum = pointers_block.pointers[k];
-				if(blockNum <=super.super.ninodeblocks || blockNum >= diskSize )
-				{
-					printf("Error Writing: Invalid block number detected in Filesystem.\n");
-					return written;
-				}
-				else{
-					if(startIndirectByte > 0)
-					{
-						to_write = ((length-written) > BYTES_PER_BLOCK - startIndirectByte) ? (BYTES_PER_BLOCK-startIndirectByte) : length-written;
-						memcpy(&writeBlock.data[startIndirectByte], &data[written], to_write);
-						startIndirectByte = 0;
-					}
-					else
-					{
-						to_write = ((length - written) > BYTES_PER_BLOCK) ? BYTES_PER_BLOCK : length-written;
-						memcpy(writeBlock.data, &data[written],to_write); 	
-					}
-					disk_write(blockNum, writeBlock.data);
-					written += to_write;
-				}
-				
+			if(depth > 1)
+				changed |= tree_release(&block.pointers[i], depth-1, start, from, to);
+			else if(block_valid(block.pointers[i]))
+			{
+				blocks_free(block.pointers[i], 1);
+				block.pointers[i] = 0;
+				changed = 1;
 			}
-
-			if(changedPointersBlock)
-				disk_write(inodeB.inode[inodeIndex].indirect, pointers_block.data);
 		}
-
+		if(block.pointers[i])
+			empty = 0;
 	}
-	else{
-		printf("Error Writing: The inode is invalid\n");
-		return 0;
+	if(empty)
+	{
+		blocks_free(*slot, 1);
+		*slot = 0;
+		return 1;
+	}
+	if(changed)
+		meta_write(*slot, block.data);
+	return 0;
+}
+
+static void pointers_release( int inumber, struct fs_inode *inode, int64_t from, int64_t to )
+{
+	int *roots[INDIRECT_LEVELS] = { &inode->indirect, &inode->dindirect, &inode->tindirect };
+	int64_t base = POINTERS_PER_INODE;
+	int64_t l;
+	int k;
 
+	for(l = from; l < to && l < POINTERS_PER_INODE; l++)
+	{
+		if(block_valid(inode->direct[l]))
+			blocks_free(inode->direct[l], 1);
+		inode->direct[l] = 0;
 	}
-	// Above we made sure bytes written would not exceed max file size
-	int max_size = BYTES_PER_BLOCK*(POINTERS_PER_INODE + POINTERS_PER_BLOCK);
-	if(offset+written > size){
-		int new_size = (offset + written > max_size) ? max_size : offset + written;
-		inodeB.inode[inodeIndex].size = new_size;
-		disk_write(inodeBlock + 1, inodeB.data);
+	for(k = 0; k < INDIRECT_LEVELS; k++)
+	{
+		tree_release(roots[k], k+1, base, from, to);
+		base += tree_span(k+2);
 	}
-	return written;
+	inode_dirty(inumber);
 }
 
-
-int getNewInode()
+// Lengthen the chain of extent blocks to hold a list of n extents. Returns
+// 0 if the disk is full; extents_store frees any blocks left unused.
+static int extents_grow( int inumber, struct fs_inode *inode, int n )
 {
-	int i;
-	_Bool found = 0;
-	for(i = 0; i<bitmapSize ; i++)
+	int chain[MAX_EXTENT_BLOCKS];
+	union fs_block block;
+	int k = extents_chain_with(inode, chain, cache_read);
+
+	if(k < 0)
+		return 0;
+	while(k < extent_blocks(n))
 	{
-		if(bitmap[i] == 0)
+		int blocknum = alloc_block(inumber, 0, 1);
+		if(blocknum < 0)
 		{
-			bitmap[i] = 1;
-			found = 1;
-			break;
+			printf("System has run out of memory. Please delete some files to free memory\n");
+			return 0;
+		}
+		memset(block.data, 0, BYTES_PER_BLOCK);
+		meta_write(blocknum, block.data);
+		if(k == 0)
+		{
+			inode->extentblock = blocknum;
+			inode_dirty(inumber);
+		}
+		else
+		{
+			cache_read(chain[k-1], block.data);
+			block.extents.next = blocknum;
+			meta_write(chain[k-1], block.data);
 		}
+		chain[k++] = blocknum;
+	}
+	return 1;
+}
+
+// Returns 0, changing nothing, if the list is corrupt or the hole would
+// split it into too many extents. ext, old and out are scratch lists.
+static int extents_punch_with( int inumber, struct fs_inode *inode, int64_t from, int64_t to, struct fs_extent *ext, struct fs_extent *old, struct fs_extent *out )
+{
+	int n = extents_load(inode, ext);
+	int nold = n;
+	int pos = 0;
+	int i;
+
+	if(n < 0)
+	{
+		printf("Error Freeing Blocks: Invalid extent list detected in Filesystem.\n");
+		return 0;
+	}
+	for(i = 0; i < n; i++)
+		pos += ext[i].length;
+	if(to > pos)
+		to = pos;
+	if(from >= to)
+		return 1;
+
+	memcpy(old, ext, n*sizeof(struct fs_extent));
+	if(!extents_replace(ext, &n, from, to - from, 0, out))
+	{
+		printf("Error Freeing Blocks: The file would have more than %d extents.\n", MAX_EXTENTS);
+		return 0;
+	}
+	if(!extents_grow(inumber, inode, n))
+	{
+		extents_store(inumber, inode, old, nold);
+		return 0;
+	}
+
+	for(i = 0, pos = 0; i < nold; pos += old[i].length, i++)
+	{
+		int64_t a = (from > pos ? from : pos);
+		int64_t b = (to < pos + old[i].length ? to : pos + old[i].length);
+		if(old[i].start && a < b)
+			blocks_free(old[i].start + (a - pos), b - a);
+	}
+	extents_store(inumber, inode, ext, n);
+	return 1;
+}
+
+static int extents_punch( int inumber, struct fs_inode *inode, int64_t from, int64_t to )
+{
+	struct fs_extent *ext = extents_alloc();
+	struct fs_extent *old = extents_alloc();
+	struct fs_extent *out = extents_alloc();
+	int result = (ext && old && out ? extents_punch_with(inumber, inode, from, to, ext, old, out) : 0);
+	free(ext);
+	free(old);
+	free(out);
+	return result;
+}
+
+// Free the blocks behind logical blocks from..to-1, leaving a hole.
+static int inode_release( int inumber, struct fs_inode *inode, int64_t from, int64_t to )
+{
+	if(from >= to)
+		return 1;
+	if(fs_extents())
+		return extents_punch(inumber, inode, from, to);
+	pointers_release(inumber, inode, from, to);
+	return 1;
+}
+
+static void tables_free(void)
+{
+	int i;
+	for(i = 0; i < MAX_STREAMS; i++)
+		streams[i].inumber = 0;
+	for(i = 0; inodeTable && i < superBlock.ninodeblocks; i++)
+		free(inodeTable[i]);
+	free(inodeTable);
+	free(inodeDirty);
+	bitmap_delete(inodeMap);
+	bitmap_delete(bitmap);
+	bitmap_delete(pendingFree);
+	bitmap_delete(journaledBlocks);
+	inodeTable = NULL;
+	inodeDirty = NULL;
+	inodeMap = NULL;
+	bitmap = NULL;
+	pendingFree = NULL;
+	journaledBlocks = NULL;
+	npendingFree = 0;
+}
+
+// Allocate the in-memory bitmaps and inode table for superBlock.
+static int tables_create(void)
+{
+	pthread_once(&locksOnce, locks_init);
+	bitmap = bitmap_create(superBlock.nblocks);
+	inodeMap = bitmap_create(superBlock.ninodes);
+	inodeTable = calloc(superBlock.ninodeblocks, sizeof(union fs_block *));
+	inodeDirty = calloc(superBlock.ninodeblocks, sizeof(_Bool));
+	if(fs_journaled())
+	{
+		pendingFree = bitmap_create(superBlock.nblocks);
+		journaledBlocks = bitmap_create(superBlock.nblocks);
+	}
+	if(!bitmap || !inodeMap || !inodeTable || !inodeDirty || (fs_journaled() && (!pendingFree || !journaledBlocks)))
+	{
+		tables_free();
+		return 0;
+	}
+	bitmap_set_range(bitmap, 0, first_data_block());
+	bitmap_set(inodeMap, 0);
+	return 1;
+}
+
+
+static int format_disk( int flags )
+{
+	if(fs_mounted == 1)
+	{
+		printf("Formatting Error: Can't format a mounted FS\n");
+		return 0;
+		
+	}
+	int blocks = disk_size();
+	int ninode_blocks = blocks / 10;
+	if(blocks < 3)
+	{
+		printf("Not enough blocks to build a file system!\n");
+		return 0;
+	}
+	if(ninode_blocks != 0){
+		if(blocks % ninode_blocks != 0)
+			ninode_blocks++; // Round up
 	}
-	if(found)
-		return i;
 	else
-		return -1;
+	{
+		ninode_blocks = 1;
+	}
+	union fs_block block;
+	memset(block.data, 0, BYTES_PER_BLOCK);
+
+	// Format super
+	block.super.magic = FS_MAGIC;
+	block.super.version = FS_VERSION;
+	block.super.nblocks = blocks;
+	block.super.ninodeblocks = ninode_blocks;
+	block.super.flags = flags;
+	superBlock.flags = flags;
+	block.super.ninodes = ninode_blocks*inodes_per_block();
+	block.super.nbitmapblocks = map_blocks(blocks) + map_blocks(block.super.ninodes);
+	block.super.clean = 1;
+	if(flags & FS_FORMAT_JOURNAL)
+	{
+		int njournal = blocks / 32;
+		if(njournal < JOURNAL_MIN_BLOCKS)
+			njournal = JOURNAL_MIN_BLOCKS;
+		if(njournal > JOURNAL_MAX_BLOCKS)
+			njournal = JOURNAL_MAX_BLOCKS;
+		block.super.journalblocks = njournal;
+	}
+	if(1 + ninode_blocks + block.super.nbitmapblocks + block.super.journalblocks >= blocks)
+	{
+		printf("Not enough blocks to build a file system!\n");
+		return 0;
+	}
+
+	cache_write(0,block.data);
+	superBlock = block.super;
+
+	// Invalidate all inodes
+	
+	int i;
+	int j;
+	union fs_block iblock;
+	for(i = 0; i < ninode_blocks; i++)
+	{
+		cache_read(i+1, iblock.data);
+		
+		for(j = 0; j < inodes_per_block() ; j++)
+		{
+			block_inode(&iblock, j)->isvalid = 0;
+			block_inode(&iblock, j)->nextents = 0;
+		}
+
+		cache_write(i+1,iblock.data);
+
+	}
+
+	// Save bitmaps with only the metadata blocks and inode 0 in use
+	struct bitmap *blockMap = bitmap_create(blocks);
+	struct bitmap *usedInodes = bitmap_create(block.super.ninodes);
+	bitmap_set_range(blockMap, 0, first_data_block());
+	bitmap_set(usedInodes, 0);
+	map_store(blockMap, ninode_blocks + 1);
+	map_store(usedInodes, ninode_blocks + 1 + map_blocks(blocks));
+	bitmap_delete(blockMap);
+	bitmap_delete(usedInodes);
+
+	// An empty journal; the zeroed block keeps an old transaction from
+	// looking like the first new one.
+	if(block.super.journalblocks > 0)
+	{
+		memset(iblock.data, 0, BYTES_PER_BLOCK);
+		disk_write(journal_start() + 1, iblock.data);
+		journalSeq = 1;
+		journal_header(0);
+	}
+
+	return 1;
+}
+
+int fs_format( int flags )
+{
+	int64_t start = stats_start();
+	int result = format_disk(flags);
+	stats_record(STATS_FS_FORMAT, start, 0);
+	return result;
+}
+
+static void debug_visit( void *arg, int blocknum, int meta )
+{
+	if(!meta)
+		printf(" %d",blocknum);
+}
+
+static void debug_count( void *arg, int blocknum, int meta )
+{
+	if(!meta)
+		(*(int64_t *)arg)++;
+}
+
+// Data blocks an inode holds, not counting holes, or -1 if it is corrupt.
+static int64_t debug_stored( struct fs_inode *inode )
+{
+	int64_t stored = 0;
+	int k;
+
+	if(fs_extents())
+	{
+		struct fs_extent *ext = extents_alloc();
+		if(!ext)
+			return -1;
+		int n = extents_load(inode, ext);
+		for(k = 0; k < n; k++)
+		{
+			if(ext[k].start)
+				stored += ext[k].length;
+		}
+		free(ext);
+		return (n < 0 ? -1 : stored);
+	}
+	return (pointers_walk(inode, cache_read, debug_count, &stored) ? stored : -1);
+}
+
+static void debug_dirent( void *arg, const char *name, int inumber, int isdir )
+{
+	printf("\t\t%s%s: inode %d\n",name,isdir ? "/" : "",inumber);
+}
+
+static void debug_disk(void)
+{
+	static const char *levelNames[INDIRECT_LEVELS] = { "", "double ", "triple " };
+	union fs_block block;
+
+	if(fs_mounted)
+		block.super = superBlock;
+	else
+	{
+		cache_read(0,block.data);
+		superBlock = block.super;
+	}
+
+	printf("superblock:\n");
+	printf("\t%s format\n",fs_extents() ? "extent" : "block pointer");
+	if(fs_inline())
+		printf("\t%d byte inodes, up to %d bytes of data inline\n",INLINE_INODE_SIZE,INLINE_DATA_BYTES);
+	printf("\t%d blocks\n",block.super.nblocks);
+	printf("\t%d inode blocks\n",block.super.ninodeblocks);
+	printf("\t%d inodes\n",block.super.ninodes);
+	printf("\t%d bitmap blocks\n",block.super.nbitmapblocks);
+	if(block.super.journalblocks > 0)
+		printf("\t%d journal blocks\n",block.super.journalblocks);
+	printf("\t%s\n",block.super.clean ? "clean" : "not cleanly unmounted");
+	if(fs_mounted)
+		printf("\t%d free blocks\n",bitmap_count_free(bitmap));
 	
+	int i;
+	int j;
+	int k;
+	int64_t stored = 0;
+	int64_t logical = 0;
+	union fs_block scratch;
+	union fs_block *iblock;
+	for(i = 1; i <= block.super.ninodeblocks; i++){ 
+		if(fs_mounted)
+		{
+			iblock = inode_block(i-1);
+			if(!iblock)
+				continue;
+		}
+		else
+		{
+			cache_read(i, scratch.data);
+			iblock = &scratch;
+		}
+		for(j = 0; j < inodes_per_block() ; j++){
+			struct fs_inode *inode = block_inode(iblock, j);
+			if(inode->isvalid == 1){
+				printf("inode %d:\n",j+inodes_per_block()*(i-1));
+				int64_t size = inode->size;
+				printf("\tsize: %lld bytes\n",(long long)size);
+				if(inode->flags & INODE_INLINE)
+				{
+					printf("\tinline data\n");
+					continue;
+				}
+				if(inode->flags & INODE_DIR)
+				{
+					printf("\tdirectory entries:\n");
+					if(dir_list(j+inodes_per_block()*(i-1), inode, debug_dirent, NULL) < 0)
+						printf("\t\t(corrupt)\n");
+				}
+				if(inode->flags & INODE_COMPRESSED)
+				{
+					int64_t n = debug_stored(inode);
+					int64_t m = size_blocks(size);
+					if(n >= 0)
+					{
+						printf("\tcompressed: %lld blocks stored for %lld, %.1f%% saved\n",(long long)n,(long long)m,m ? 100.0*(m-n)/m : 0.0);
+						stored += n;
+						logical += m;
+					}
+				}
+				if(fs_extents())
+				{
+					struct fs_extent *ext = extents_alloc();
+					if(!ext)
+						continue;
+					int chain[MAX_EXTENT_BLOCKS];
+					int n = extents_load(inode, ext);
+					int nchain = extents_chain_with(inode, chain, cache_read);
+					if(n < 0 || nchain < 0)
+					{
+						printf("\tcorrupt extent list\n");
+						free(ext);
+						continue;
+					}
+					if(nchain > 0)
+					{
+						printf("\textent blocks:");
+						for(k = 0; k < nchain; k++)
+							printf(" %d",chain[k]);
+						printf("\n");
+					}
+					printf("\textents:");
+					for(k = 0; k < n; k++)
+					{
+						if(ext[k].start)
+							printf(" %d-%d",ext[k].start,ext[k].start+ext[k].length-1);
+						else
+							printf(" hole*%d",ext[k].length);
+					}
+					printf("\n");
+					free(ext);
+					continue;
+				}
+				int64_t nblocks = inode_blocks(inode);
+				if(size < 0 || nblocks > MAX_FILE_BLOCKS)
+				{
+					printf("Size exceeds FileSystem Capability\n");
+					return ;
+				}
+
+				int direct_blocks = ( nblocks > POINTERS_PER_INODE ? POINTERS_PER_INODE : nblocks);
+				printf("\tdirect blocks:");
+				for(k = 0; k < direct_blocks; k++)
+				{
+					printf(" %d",inode->direct[k]);	
+
+				}
+				printf("\n");
+				nblocks -= direct_blocks;
+
+				int roots[INDIRECT_LEVELS] = { inode->indirect, inode->dindirect, inode->tindirect };
+				for(k = 0; k < INDIRECT_LEVELS && nblocks > 0; k++)
+				{
+					int64_t indirect_blocks = tree_span(k+2);
+					if(indirect_blocks > nblocks)
+						indirect_blocks = nblocks;
+					printf("\t%sindirect block: %d\n",levelNames[k],roots[k]);
+					printf("\t%sindirect data blocks:",levelNames[k]);
+					if(!tree_walk(roots[k], k+1, indirect_blocks, cache_read, debug_visit, NULL))
+						printf(" (corrupt)");
+					printf("\n");
+					nblocks -= indirect_blocks;
+				}
+			}
+		}
+	}
+	if(logical > 0)
+		printf("compressed files: %lld blocks stored for %lld, %.1f%% saved\n",(long long)stored,(long long)logical,100.0*(logical-stored)/logical);
+}
+
+void fs_debug()
+{
+	int64_t start = stats_start();
+	debug_disk();
+	stats_record(STATS_FS_DEBUG, start, 0);
+}
+
+void print_bitmap(void)
+{
+	int i;
+	int nl = 0;
+	for(i = 0; i < bitmap->nbits; i++)
+	{
+		printf("%d:%d,", i,bitmap_test(bitmap,i));
+		nl +=1;
+		if(nl > 10){
+			printf("\n");
+			nl = 0;
+		}
+	}
+	printf("\n");
+
+}
+
+
+// One slice of the inode table, scanned by one thread into its own
+// partial bitmaps. Blocks it sees claimed twice are counted as duplicates.
+struct scan_job {
+	pthread_t thread;
+	_Bool started;
+	int first;
+	int last;
+	struct bitmap *blocks;
+	struct bitmap *inodes;
+	int duplicates;
+	int error;
+};
+
+// The cache is flushed before a scan, so workers read the disk directly
+// and concurrently.
+static void scan_read( int blocknum, char *data )
+{
+	disk_readv(blocknum, 1, &data);
+}
+
+static void scan_claim( struct scan_job *job, int start, int count )
+{
+	job->duplicates += bitmap_test_range(job->blocks, start, count);
+	bitmap_set_range(job->blocks, start, count);
+}
+
+static void scan_visit( void *arg, int blocknum, int meta )
+{
+	scan_claim(arg, blocknum, 1);
+}
+
+static void *scan_worker( void *arg )
+{
+	struct scan_job *job = arg;
+	int i;
+	int j;
+	int k;
+
+	for(i = job->first; i < job->last; i++){
+		union fs_block *iblock = malloc(sizeof(union fs_block));
+		if(!iblock)
+		{
+			printf("Error Mounting FS: Couldn't allocate the inode table.\n");
+			job->error = 1;
+			return NULL;
+		}
+		scan_read(i+1, iblock->data);
+		inodeTable[i] = iblock;
+		for(j = 0; j < inodes_per_block() ; j++){
+			struct fs_inode *inode = block_inode(iblock, j);
+			if(inode->isvalid == 1){
+				bitmap_set(job->inodes, j+inodes_per_block()*i);
+				if(inode->flags & INODE_INLINE)
+				{
+					if(inode->size < 0 || inode->size > INLINE_DATA_BYTES)
+					{
+						printf("Error Mounting FS: Invalid inline file size detected in Filesystem.\n");
+						job->error = 1;
+						return NULL;
+					}
+					continue;
+				}
+				if(fs_extents())
+				{
+					struct fs_extent *ext = extents_alloc();
+					if(!ext)
+					{
+						job->error = 1;
+						return NULL;
+					}
+					int chain[MAX_EXTENT_BLOCKS];
+					int n = extents_load_with(inode, ext, scan_read);
+					int nchain = extents_chain_with(inode, chain, scan_read);
+					int64_t total = 0;
+					for(k = 0; k < n; k++)
+					{
+						if(ext[k].start)
+							scan_claim(job, ext[k].start, ext[k].length);
+						total += ext[k].length;
+					}
+					for(k = 0; k < nchain; k++)
+						scan_claim(job, chain[k], 1);
+					free(ext);
+					if(n < 0 || nchain < extent_blocks(n) || total > inode_blocks(inode))
+					{
+						printf("Error Mounting FS: Invalid extent list detected in Filesystem.\n");
+						job->error = 1;
+						return NULL;
+					}
+					continue;
+				}
+				if(!pointers_walk(inode, scan_read, scan_visit, job))
+				{
+					printf("Error Mounting FS: Invalid block number or size detected in Filesystem.\n");
+					job->error = 1;
+					return NULL;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+// Rebuild the block and inode bitmaps by walking every inode block and
+// every indirect or extent block, split across a pool of threads whose
+// partial bitmaps are merged at the end. Returns 0 if the filesystem is
+// corrupt. *duplicates is set to the number of blocks claimed twice.
+static int scan_inodes( int *duplicates )
+{
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int per;
+	int i;
+	int error = 0;
+
+	if(nthreads > MAX_SCAN_THREADS)
+		nthreads = MAX_SCAN_THREADS;
+	if(nthreads > superBlock.ninodeblocks/MIN_SCAN_BLOCKS)
+		nthreads = superBlock.ninodeblocks/MIN_SCAN_BLOCKS;
+	if(nthreads < 1)
+		nthreads = 1;
+	per = (superBlock.ninodeblocks + nthreads - 1)/nthreads;
+
+	cache_flush();
+	*duplicates = 0;
+
+	struct scan_job jobs[MAX_SCAN_THREADS];
+	for(i = 0; i < nthreads; i++)
+	{
+		jobs[i].first = i*per;
+		jobs[i].last = (i+1)*per < superBlock.ninodeblocks ? (i+1)*per : superBlock.ninodeblocks;
+		jobs[i].blocks = bitmap_create(superBlock.nblocks);
+		jobs[i].inodes = bitmap_create(superBlock.ninodes);
+		jobs[i].duplicates = 0;
+		jobs[i].error = 0;
+		if(!jobs[i].blocks || !jobs[i].inodes)
+		{
+			printf("Error Mounting FS: Couldn't allocate the scan bitmaps.\n");
+			jobs[i].error = 1;
+			jobs[i].started = 0;
+			continue;
+		}
+		jobs[i].started = (nthreads > 1 && pthread_create(&jobs[i].thread, NULL, scan_worker, &jobs[i]) == 0);
+		if(!jobs[i].started)
+			scan_worker(&jobs[i]);
+	}
+
+	for(i = 0; i < nthreads; i++)
+	{
+		if(jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		error |= jobs[i].error;
+		if(jobs[i].blocks && jobs[i].inodes)
+		{
+			*duplicates += jobs[i].duplicates;
+			*duplicates += bitmap_merge(bitmap, jobs[i].blocks);
+			bitmap_merge(inodeMap, jobs[i].inodes);
+		}
+		bitmap_delete(jobs[i].blocks);
+		bitmap_delete(jobs[i].inodes);
+	}
+	return !error;
+}
+
+static int mount_disk(void)
+{
+	union fs_block block;
+
+	cache_read(0,block.data);
+	// Check Magic
+	if(!super_valid(&block.super))
+		return 0;
+	// Pinned blocks only stay off the disk until their commit in the cache
+	if((block.super.flags & FS_FORMAT_JOURNAL) && cache_nblocks() == 0)
+	{
+		printf("Error Mounting FS: A journaled filesystem needs a cache\n");
+		return 0;
+	}
+
+	if(fs_mounted)
+		fs_unmount();
+
+	superBlock = block.super;
+	if(!tables_create())
+	{
+		printf("Error Mounting: Couldn't allocate the in-memory tables.\n");
+		return 0;
+	}
+
+	// After a clean unmount the saved bitmaps are current and the inode
+	// table is only read as inodes are used. After a crash, replaying the
+	// journal makes them current again. Otherwise scan everything.
+	_Bool current = superBlock.nbitmapblocks > 0 && superBlock.clean;
+	if(fs_journaled())
+	{
+		int needscan = 0;
+		int replayed = journal_replay(&needscan);
+		if(replayed > 0)
+			printf("Mount: replayed %d journal transactions.\n", replayed);
+		current = !needscan;
+	}
+	if(current)
+	{
+		map_load(bitmap, superBlock.ninodeblocks + 1);
+		map_load(inodeMap, superBlock.ninodeblocks + 1 + map_blocks(superBlock.nblocks));
+	}
+	else
+	{
+		int duplicates;
+		if(!scan_inodes(&duplicates))
+		{
+			tables_free();
+			return 0;
+		}
+		if(duplicates > 0)
+			printf("Mount Warning: %d blocks are claimed by more than one inode.\n", duplicates);
+		if(fs_journaled())
+		{
+			map_store(bitmap, superBlock.ninodeblocks + 1);
+			map_store(inodeMap, superBlock.ninodeblocks + 1 + map_blocks(superBlock.nblocks));
+			cache_flush();
+			disk_sync();
+		}
+	}
+	if(fs_journaled() && !superBlock.clean)
+		journal_header(0);
+
+	superBlock.clean = 0;
+	super_store();
+	fs_mounted = 1;	
+	//print_bitmap();
+	return 1;
+}
+
+int fs_mount()
+{
+	int64_t start = stats_start();
+	int result = mount_disk();
+	stats_record(STATS_FS_MOUNT, start, 0);
+	return result;
+}
+
+// Make everything written so far durable, in two ordered steps: the data
+// blocks, then the metadata that refers to them. Without a journal that is
+// the pointer blocks with the data and the inode blocks after them, and
+// after a crash the mount scan rebuilds the bitmaps from the inodes. With
+// one, all of the metadata is logged as one transaction.
+static int commit(void)
+{
+	int ok = 1;
+
+	pthread_once(&locksOnce, locks_init);
+	pthread_rwlock_wrlock(&commitGate);
+
+	cache_flush();
+	disk_sync();
+	if(fs_journaled())
+	{
+		ok = journal_commit();
+	}
+	else
+	{
+		inode_sync();
+		cache_flush();
+		disk_sync();
+	}
+
+	pthread_rwlock_unlock(&commitGate);
+	return ok;
+}
+
+static int unmount_disk(void)
+{
+	if(!fs_mounted)
+	{
+		printf("No mounted filesystem found\n");
+		return 0;
+	}
+	reservation_drop_all();
+	if(fs_journaled())
+	{
+		// Writing anything in place now would lose the pinned blocks
+		if(!commit())
+		{
+			printf("Unmount Error: The last commit failed, so the filesystem stays mounted.\n");
+			return 0;
+		}
+		journal_checkpoint();
+	}
+	inode_sync();
+	if(superBlock.nbitmapblocks > 0)
+	{
+		map_store(bitmap, superBlock.ninodeblocks + 1);
+		map_store(inodeMap, superBlock.ninodeblocks + 1 + map_blocks(superBlock.nblocks));
+		cache_flush();
+		disk_sync();
+		superBlock.clean = 1;
+		super_store();
+	}
+	cache_flush();
+	disk_sync();
+	tables_free();
+	fs_mounted = 0;
+	return 1;
+}
+
+int fs_unmount()
+{
+	int64_t start = stats_start();
+	int result = unmount_disk();
+	stats_record(STATS_FS_UNMOUNT, start, 0);
+	return result;
+}
+
+int fs_sync()
+{
+	int64_t start = stats_start();
+	int64_t ticket;
+
+	if(!fs_mounted)
+	{
+		printf("No mounted filesystem found\n");
+		return 0;
+	}
+
+	pthread_mutex_lock(&commitLock);
+	ticket = ++commitsRequested;
+	while(commitsDone < ticket)
+	{
+		if(committing)
+		{
+			pthread_cond_wait(&commitDone, &commitLock);
+			continue;
+		}
+		int64_t covered = commitsRequested;
+		committing = 1;
+		__atomic_store_n(&pendingUpdates, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&commitLock);
+		int ok = commit();
+		pthread_mutex_lock(&commitLock);
+		commitsDone = covered;
+		commitFailed = !ok;
+		committing = 0;
+		pthread_cond_broadcast(&commitDone);
+	}
+	// A later commit that covered this one too overwrites the result
+	int result = !commitFailed;
+	pthread_mutex_unlock(&commitLock);
+
+	stats_record(STATS_FS_SYNC, start, 0);
+	return result;
+}
+
+// Called after each call that changed a file, holding no inode lock.
+// With a journal, a commit is also due once the pinned metadata would
+// fill half of it or of a cache shard, or many deleted blocks are waiting
+// to be freed.
+static void commit_note(void)
+{
+	int interval = commitInterval;
+	if(fs_journaled() && (cache_npinned() >= journal_capacity()/2 || cache_crowded() || __atomic_load_n(&npendingFree, __ATOMIC_RELAXED) >= superBlock.nblocks/32))
+		fs_sync();
+	else if(interval > 0 && __atomic_add_fetch(&pendingUpdates, 1, __ATOMIC_RELAXED) == interval)
+		fs_sync();
+}
+
+// Scan an unmounted filesystem and compare what the inodes claim with the
+// saved bitmaps. Returns 1 if everything is consistent.
+struct check_names {
+	struct bitmap *named;
+	int bad;
+};
+
+static void check_dirent( void *arg, const char *name, int inumber, int isdir )
+{
+	struct check_names *check = arg;
+	struct fs_inode *inode = (inumber > 0 ? inode_get(inumber) : NULL);
+
+	if(!inode || !inode->isvalid)
+		printf("Check Error: %s names inode %d, which is invalid\n", name, inumber);
+	else if(!(inode->flags & INODE_NAMED) || !isdir != !(inode->flags & INODE_DIR))
+		printf("Check Error: %s names inode %d, which is not a named %s\n", name, inumber, isdir ? "directory" : "file");
+	else if(bitmap_test(check->named, inumber))
+		printf("Check Error: %s names inode %d, which already has a name\n", name, inumber);
+	else
+	{
+		bitmap_set(check->named, inumber);
+		return;
+	}
+	check->bad++;
+}
+
+// Every directory entry has to name a valid inode of its kind, and every
+// inode flagged INODE_NAMED has to have exactly one entry. Returns how many
+// of them don't.
+static int check_names(void)
+{
+	struct check_names check;
+	int i;
+
+	check.named = bitmap_create(superBlock.ninodes);
+	check.bad = 0;
+	for(i = 0; i < superBlock.ninodes; i++)
+	{
+		struct fs_inode *inode = inode_get(i);
+		if(inode && inode->isvalid && (inode->flags & INODE_DIR) && dir_list(i, inode, check_dirent, &check) < 0)
+		{
+			printf("Check Error: Directory %d is corrupt\n", i);
+			check.bad++;
+		}
+	}
+	for(i = 1; i < superBlock.ninodes; i++)
+	{
+		struct fs_inode *inode = inode_get(i);
+		if(inode && inode->isvalid && (inode->flags & INODE_NAMED) && !bitmap_test(check.named, i))
+		{
+			printf("Check Error: Inode %d is flagged as named, but no directory entry names it\n", i);
+			check.bad++;
+		}
+	}
+	bitmap_delete(check.named);
+	return check.bad;
+}
+
+static int check_disk(void)
+{
+	union fs_block block;
+	int duplicates = 0;
+	int ok;
+
+	if(fs_mounted)
+	{
+		printf("Check Error: Unmount the filesystem before checking it\n");
+		return 0;
+	}
+	cache_read(0,block.data);
+	if(!super_valid(&block.super))
+		return 0;
+	superBlock = block.super;
+	if(!tables_create())
+	{
+		printf("Check Error: Couldn't allocate the in-memory tables.\n");
+		return 0;
+	}
+
+	ok = scan_inodes(&duplicates);
+	printf("%d inodes in use\n", superBlock.ninodes - inodeMap->nfree - 1);
+	printf("%d data blocks in use\n", superBlock.nblocks - bitmap->nfree - first_data_block());
+	printf("%d blocks claimed by more than one inode\n", duplicates);
+	ok = ok && duplicates == 0;
+
+	// Directories are only read once the scan has found the block maps sound
+	if(ok)
+	{
+		int bad = check_names();
+		printf("%d directory entries or names in error\n", bad);
+		if(fs_journaled() && !superBlock.clean)
+			printf("the journal has not been replayed: mount the filesystem to bring the directories up to date\n");
+		else
+			ok = bad == 0;
+	}
+
+	if(superBlock.nbitmapblocks > 0)
+	{
+		struct bitmap *saved = bitmap_create(superBlock.nblocks);
+		map_load(saved, superBlock.ninodeblocks + 1);
+		int leaked = bitmap_count_diff(saved, bitmap);
+		int unmarked = bitmap_count_diff(bitmap, saved);
+		printf("%d blocks marked used but not claimed by any inode\n", leaked);
+		printf("%d blocks claimed but marked free\n", unmarked);
+		if(!superBlock.clean)
+			printf("the saved bitmap is stale: the filesystem was not cleanly unmounted\n");
+		else
+			ok = ok && leaked == 0 && unmarked == 0;
+		bitmap_delete(saved);
+	}
+
+	tables_free();
+	return ok;
+}
+
+int fs_check()
+{
+	int64_t start = stats_start();
+	int result = check_disk();
+	stats_record(STATS_FS_CHECK, start, 0);
+	return result;
+}
+
+static int inode_create(void)
+{
+	if(!fs_mounted)
+	{
+		printf("No mounted filesystem found\n");
+		return 0;
+	}
+
+	int i = bitmap_alloc(inodeMap);
+	if(i < 0)
+		return 0;
+
+	inode_wrlock(i);
+	struct fs_inode *inode = inode_get(i);
+	if(!inode)
+	{
+		inode_unlock(i);
+		bitmap_clear(inodeMap, i);
+		return 0;
+	}
+	memset(inode, 0, inode_size());
+	inode->isvalid = 1;
+	if(fs_inline())
+		inode->flags = INODE_INLINE;
+	inode_dirty(i);
+	inode_unlock(i);
+	return i;
+}
+
+int fs_create()
+{
+	int64_t start = stats_start();
+	gate_enter();
+	int result = inode_create();
+	gate_leave();
+	stats_record(STATS_FS_CREATE, start, 0);
+	if(result > 0)
+		commit_note();
+	return result;
+}
+
+static void release_visit( void *arg, int blocknum, int meta )
+{
+	blocks_free(blocknum, 1);
+}
+
+static int inode_delete( int inumber )
+{
+	if(!fs_mounted)
+	{
+		printf("No mounted filesystem found\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = inode_get(inumber);
+	if(!inode){
+		printf("Invalid inumber\n");
+		return 0;
+	}
+	
+	_Bool Error = 0;
+
+	if(inode->isvalid && (inode->flags & INODE_DIR))
+	{
+		printf("Error Deleting Inode: The inode is a directory\n");
+		return 0;
+	}
+	if(inode->isvalid && (inode->flags & INODE_NAMED))
+	{
+		printf("Error Deleting Inode: The inode has a name, so unlink it by path\n");
+		return 0;
+	}
+
+	reservation_drop_inode(inumber);
+	stream_drop(inumber);
+	if(inode->isvalid && (inode->flags & INODE_INLINE))
+	{
+		// No blocks to free
+	}
+	else if(inode->isvalid && fs_extents())
+	{
+		// Without memory to load the list nothing was freed, so the inode stays
+		int released = extents_release(inode);
+		if(released < 0)
+			return 0;
+		if(!released)
+		{
+			printf("Error Deleting Inode: Invalid extent list detected in Filesystem.\n");
+			Error = 1;
+		}
+		inode->nextents = 0;
+	}
+	else if(inode->isvalid)
+	{
+		if(!pointers_walk(inode, cache_read, release_visit, NULL))
+		{
+			printf("Error Deleting Inode: Invalid block number or size detected in Filesystem.\n");
+			Error = 1;
+		}
+	}
+	else{
+		printf("Error Deleting Inode: The inode is invalid\n");
+		return 0;
+
+	}
+	// Write to inode
+	inode->size = 0;
+	inode->isvalid = 0;
+	inode_dirty(inumber);
+	bitmap_clear(inodeMap, inumber);
+	if(Error)
+	{
+		printf("Inode was succesfully deleted, but there may be some corruption in data\n");
+	}
+	return 1;
+}
+
+int fs_delete( int inumber )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	inode_wrlock(inumber);
+	int result = inode_delete(inumber);
+	inode_unlock(inumber);
+	gate_leave();
+	stats_record(STATS_FS_DELETE, start, 0);
+	if(result)
+		commit_note();
+	return result;
+}
+
+static int64_t inode_getsize( int inumber )
+{
+	if(!fs_mounted)
+	{
+		printf("GetSize Error: No mounted filesystem found\n");
+		return -1;
+	}
+
+	struct fs_inode *inode = inode_get(inumber);
+	if(!inode){
+		printf("GetSize Error: Invalid inumber\n");
+		return -1;
+	}
+
+	if(inode->isvalid)
+	{
+		return inode->size;
+	}
+	else
+	{
+		printf("GetSize Error: Invalid Inode\n");
+		return -1;
+	}
+	
+}
+
+int64_t fs_getsize( int inumber )
+{
+	int64_t start = stats_start();
+	inode_rdlock(inumber);
+	int64_t result = inode_getsize(inumber);
+	inode_unlock(inumber);
+	stats_record(STATS_FS_GETSIZE, start, 0);
+	return result;
+}
+
+// The pointer blocks on the path to the last block looked up, one per
+// level of an indirect tree, kept so that a run of lookups reads and
+// writes each pointer block once.
+struct pointer_path {
+	int blocknum[INDIRECT_LEVELS];
+	_Bool dirty[INDIRECT_LEVELS];
+	union fs_block block[INDIRECT_LEVELS];
+};
+
+static void path_flush( struct pointer_path *path )
+{
+	int i;
+	for(i = 0; i < INDIRECT_LEVELS; i++)
+	{
+		if(path->dirty[i])
+			meta_write(path->blocknum[i], path->block[i].data);
+		path->dirty[i] = 0;
+	}
+}
+
+// Make the pointer block blocknum current at one level of the path.
+static void path_load( struct pointer_path *path, int level, int blocknum, _Bool fresh )
+{
+	if(path->blocknum[level] == blocknum && !fresh)
+		return;
+	if(path->dirty[level])
+		meta_write(path->blocknum[level], path->block[level].data);
+	path->blocknum[level] = blocknum;
+	path->dirty[level] = fresh;
+	if(fresh)
+		memset(path->block[level].data, 0, BYTES_PER_BLOCK);
+	else
+		cache_read(blocknum, path->block[level].data);
+}
+
+// Find the slot holding the block number of logical block l, loading the
+// pointer blocks above it. With allocate set, missing pointer blocks are
+// allocated and the slot's block is marked dirty for the caller to fill.
+// Returns NULL if l is out of range, unallocated or behind a corrupt pointer.
+static int *pointer_slot( int inumber, struct fs_inode *inode, struct pointer_path *path, int l, _Bool allocate )
+{
+	int *slot;
+	int depth;
+	int level;
+	int64_t span;
+
+	if(l < POINTERS_PER_INODE)
+	{
+		if(allocate)
+			inode_dirty(inumber);
+		return &inode->direct[l];
+	}
+
+	int64_t rest = l - POINTERS_PER_INODE;
+	for(depth = 1; depth <= INDIRECT_LEVELS && rest >= tree_span(depth+1); depth++)
+		rest -= tree_span(depth+1);
+	if(depth > INDIRECT_LEVELS)
+		return NULL;
+
+	slot = (depth == 1 ? &inode->indirect : depth == 2 ? &inode->dindirect : &inode->tindirect);
+	for(level = 0; level < depth; level++)
+	{
+		if(*slot == 0)
+		{
+			if(!allocate)
+				return NULL;
+			int newBlock = bitmap_alloc(bitmap);
+			if(newBlock < 0)
+			{
+				printf("System has run out of memory. Please delete some files to free memory\n");
+				return NULL;
+			}
+			*slot = newBlock;
+			if(level == 0)
+				inode_dirty(inumber);
+			else
+				path->dirty[level-1] = 1;
+			path_load(path, level, newBlock, 1);
+		}
+		else if(!block_valid(*slot))
+		{
+			printf("Error Mapping Inode: Invalid indirect block detected in Filesystem.\n");
+			return NULL;
+		}
+		else
+		{
+			path_load(path, level, *slot, 0);
+		}
+		span = tree_span(depth - level);
+		slot = &path->block[level].pointers[(rest/span) % POINTERS_PER_BLOCK];
+	}
+	if(allocate)
+		path->dirty[depth-1] = 1;
+	return slot;
+}
+
+static int pointers_map( int inumber, struct fs_inode *inode, int first, int count, int *blocks, _Bool allocate )
+{
+	struct pointer_path *path = calloc(1, sizeof(struct pointer_path));
+	int prev = 0;
+	int *slot;
+
+	if(!path)
+	{
+		printf("Error Mapping Inode: Couldn't allocate the pointer path.\n");
+		return 0;
+	}
+
+	// New blocks are placed after the block before them
+	if(allocate && first > 0)
+	{
+		slot = pointer_slot(inumber, inode, path, first-1, 0);
+		if(slot)
+			prev = *slot;
+	}
+
+	int k;
+	for(k = 0; k < count; k++)
+	{
+		int l = first + k;
+		int blockNum;
+
+		slot = pointer_slot(inumber, inode, path, l, 0);
+		if((!slot || *slot == 0) && !allocate)
+		{
+			blocks[k] = 0;
+			prev = 0;
+			continue;
+		}
+		if(!slot)
+			slot = pointer_slot(inumber, inode, path, l, 1);
+		if(!slot)
+			break;
+
+		if(*slot == 0)
+		{
+			blockNum = alloc_block(inumber, prev ? prev + 1 : 0, count - k);
+			if(blockNum < 0)
+			{
+				printf("System has run out of memory. Please delete some files to free memory\n");
+				break;
+			}
+			// Mark the slot's block dirty
+			slot = pointer_slot(inumber, inode, path, l, 1);
+			*slot = blockNum;
+		}
+		else
+		{
+			blockNum = *slot;
+		}
+
+		if(!block_valid(blockNum))
+		{
+			printf("Error Mapping Inode: Invalid block number detected in Filesystem.\n");
+			break;
+		}
+		blocks[k] = blockNum;
+		prev = blockNum;
+	}
+
+	path_flush(path);
+	free(path);
+	return k;
+}
+
+static int extent_map( int inumber, struct fs_inode *inode, int first, int count, int *blocks, _Bool allocate )
+{
+	struct fs_extent *ext = extents_alloc();
+	// Only filling holes rearranges the list, which needs a second one
+	struct fs_extent *out = (allocate ? extents_alloc() : NULL);
+	if(!ext || (allocate && !out))
+	{
+		free(ext);
+		free(out);
+		return 0;
+	}
+	int n = extents_load(inode, ext);
+	_Bool changed = 0;
+	_Bool grew = 0;
+	if(n < 0)
+	{
+		printf("Error Mapping Inode: Invalid extent list detected in Filesystem.\n");
+		free(ext);
+		free(out);
+		return 0;
+	}
+
+	// Find the extent holding the first logical block
+	int e = 0;
+	int estart = 0;
+	while(e < n && estart + ext[e].length <= first)
+	{
+		estart += ext[e].length;
+		e++;
+	}
+
+	int k;
+	for(k = 0; k < count; k++)
+	{
+		int l = first + k;
+		if(e < n && l >= estart + ext[e].length)
+		{
+			estart += ext[e].length;
+			e++;
+		}
+		if(e < n && ext[e].start)
+		{
+			blocks[k] = ext[e].start + (l - estart);
+			continue;
+		}
+		if(!allocate)
+		{
+			blocks[k] = 0;
+			continue;
+		}
+
+		// A hole, or past the last extent: place the new block after the
+		// one before it. The chain of extent blocks is lengthened as the
+		// list outgrows it.
+		int goal = (l > 0 ? extents_lookup(ext, n, l-1) : 0);
+		int blockNum = alloc_block(inumber, goal ? goal + 1 : 0, count - k);
+		if(blockNum < 0)
+		{
+			printf("System has run out of memory. Please delete some files to free memory\n");
+			break;
+		}
+		if(!extents_replace(ext, &n, l, 1, blockNum, out))
+		{
+			printf("Error Writing: The file would have more than %d extents.\n", MAX_EXTENTS);
+			bitmap_clear(bitmap, blockNum);
+			break;
+		}
+		grew = 1;
+		if(!extents_grow(inumber, inode, n))
+		{
+			extents_replace(ext, &n, l, 1, 0, out);
+			bitmap_clear(bitmap, blockNum);
+			break;
+		}
+		blocks[k] = blockNum;
+		changed = 1;
+
+		// Find l again in the rearranged list
+		e = 0;
+		estart = 0;
+		while(e < n && estart + ext[e].length <= l)
+		{
+			estart += ext[e].length;
+			e++;
+		}
+	}
+
+	if(changed || grew || (n <= EXTENTS_PER_INODE && inode->extentblock))
+		extents_store(inumber, inode, ext, n);
+	free(ext);
+	free(out);
+	return k;
+}
+
+// Map logical blocks first..first+count-1 of an inode to physical blocks.
+// Holes map to 0 unless allocate is set, in which case they are filled.
+// Returns how many leading entries of blocks[] were filled in.
+static int inode_map( int inumber, struct fs_inode *inode, int first, int count, int *blocks, _Bool allocate )
+{
+	if(fs_extents())
+		return extent_map(inumber, inode, first, count, blocks, allocate);
+	return pointers_map(inumber, inode, first, count, blocks, allocate);
+}
+
+// Length of the physically contiguous run starting at blocks[0].
+static int run_length( const int *blocks, int count )
+{
+	int n = 1;
+	while(n < count && n < MAX_RUN_BLOCKS && blocks[n] == blocks[0] + n)
+		n++;
+	return n;
+}
+
+// Called after a read of logical blocks first..last ending just before byte
+// end. Sequential reads prefetch the next window of blocks, and the
+// pointer blocks that map them, into the cache. The window is topped up
+// once half of it has been consumed.
+static void readahead( int inumber, struct fs_inode *inode, int first, int last, int64_t end )
+{
+	struct stream *s = &streams[inumber % MAX_STREAMS];
+
+	pthread_mutex_lock(&s->lock);
+	if(s->inumber != inumber)
+	{
+		s->inumber = inumber;
+		s->next = 0;
+		s->window = 0;
+		s->ahead = 0;
+	}
+	if(first != s->next)
+	{
+		s->window = 0;
+		s->ahead = 0;
+	}
+	else if(s->window == 0)
+		s->window = MIN_READAHEAD;
+	else
+		s->window *= 2;
+	if(s->window > readaheadBlocks)
+		s->window = readaheadBlocks;
+	s->next = end/BYTES_PER_BLOCK;
+
+	int from = (s->ahead > last + 1 ? s->ahead : last + 1);
+	int64_t to = last + 1 + s->window;
+	if(to > size_blocks(inode->size))
+		to = size_blocks(inode->size);
+	if(s->window <= 0 || s->ahead - (last + 1) > s->window/2 || from >= to)
+	{
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	s->ahead = to;
+	pthread_mutex_unlock(&s->lock);
+
+	int *blocks = malloc((to - from) * sizeof(int));
+	if(!blocks)
+		return;
+	int mapped = inode_map(inumber, inode, from, to - from, blocks, 0);
+	int k = 0;
+	while(k < mapped)
+	{
+		int run = (blocks[k] ? run_length(&blocks[k], mapped - k) : 1);
+		if(blocks[k])
+			cache_prefetch(blocks[k], run);
+		k += run;
+	}
+	free(blocks);
+}
+
+// Logical block l of a transfer of length bytes at offset starts at byte
+// start of the caller's buffer, which may be negative for the head block.
+// Sets [from, to) to the part of the block inside the transfer and returns
+// 1 if that is the whole block.
+static _Bool transfer_span( int64_t offset, int length, int l, int64_t *start, int *from, int *to )
+{
+	*start = (int64_t)l*BYTES_PER_BLOCK - offset;
+	*from = (*start < 0 ? -*start : 0);
+	*to = (length - *start < BYTES_PER_BLOCK ? length - *start : BYTES_PER_BLOCK);
+	return *from == 0 && *to == BYTES_PER_BLOCK;
+}
+
+// Read count mapped blocks into buf, one call per physically contiguous run.
+static void blocks_readv( const int *blocks, int count, char *buf )
+{
+	char *bufs[MAX_RUN_BLOCKS];
+	int k = 0;
+	int i;
+	while(k < count)
+	{
+		int run = run_length(&blocks[k], count - k);
+		for(i = 0; i < run; i++)
+			bufs[i] = &buf[(int64_t)(k + i)*BYTES_PER_BLOCK];
+		cache_readv(blocks[k], run, bufs);
+		k += run;
+	}
+}
+
+// Find the blocks of chunk c of a compressed file. Returns how many it has,
+// or -1 if the map is corrupt.
+static int chunk_blocks( int inumber, struct fs_inode *inode, int64_t c, int *blocks )
+{
+	int k = 0;
+	int i;
+
+	if(inode_map(inumber, inode, c*CHUNK_BLOCKS, CHUNK_BLOCKS, blocks, 0) < CHUNK_BLOCKS)
+		return -1;
+	while(k < CHUNK_BLOCKS && blocks[k])
+		k++;
+	for(i = k; i < CHUNK_BLOCKS; i++)
+	{
+		if(blocks[i])
+			return -1;
+	}
+	return k;
+}
+
+// Read chunk c into buf, which holds CHUNK_BYTES. Returns 0 if it is corrupt.
+static int chunk_read( int inumber, struct fs_inode *inode, int64_t c, char *buf )
+{
+	int blocks[CHUNK_BLOCKS];
+	int k = chunk_blocks(inumber, inode, c, blocks);
+	int clen = 0;
+	int ok = 0;
+
+	if(k == 0)
+	{
+		memset(buf, 0, CHUNK_BYTES);
+		return 1;
+	}
+	if(k == CHUNK_BLOCKS)
+	{
+		blocks_readv(blocks, k, buf);
+		return 1;
+	}
+	if(k > 0)
+	{
+		char *packed = malloc(k*BYTES_PER_BLOCK);
+		if(!packed)
+		{
+			printf("Error Reading: Couldn't allocate a chunk buffer.\n");
+			return 0;
+		}
+		blocks_readv(blocks, k, packed);
+		memcpy(&clen, packed, sizeof(clen));
+		ok = clen > 0 && clen <= k*BYTES_PER_BLOCK - (int)sizeof(clen)
+			&& lz_decompress(&packed[sizeof(clen)], clen, buf, CHUNK_BYTES) == CHUNK_BYTES;
+		free(packed);
+	}
+	if(!ok)
+		printf("Error Reading: Corrupt compressed chunk detected in Filesystem.\n");
+	return ok;
+}
+
+// Store buf as chunk c: not at all if it is all zeros, compressed if that
+// saves at least a block, otherwise as is. Returns 0, leaving the chunk as
+// it was, if its blocks couldn't be allocated.
+static int chunk_write( int inumber, struct fs_inode *inode, int64_t c, const char *buf )
+{
+	int blocks[CHUNK_BLOCKS];
+	int old = chunk_blocks(inumber, inode, c, blocks);
+	int64_t base = c*CHUNK_BLOCKS;
+	char *packed;
+	const char *src = buf;
+	int clen;
+	int k;
+	int i;
+
+	if(old < 0)
+	{
+		printf("Error Writing: Corrupt compressed chunk detected in Filesystem.\n");
+		return 0;
+	}
+	packed = malloc(CHUNK_BYTES);
+	if(!packed)
+	{
+		printf("Error Writing: Couldn't allocate a chunk buffer.\n");
+		return 0;
+	}
+	clen = lz_compress(buf, CHUNK_BYTES, &packed[sizeof(clen)], (CHUNK_BLOCKS - 1)*BYTES_PER_BLOCK - sizeof(clen));
+	if(buf[0] == 0 && memcmp(buf, &buf[1], CHUNK_BYTES - 1) == 0)
+		k = 0;
+	else if(clen > 0)
+		k = size_blocks(sizeof(clen) + clen);
+	else
+		k = CHUNK_BLOCKS;
+
+	// Blocks no longer needed go first. If they can't be released, as when
+	// a full disk has no room for another extent block, the chunk keeps
+	// them and the compressed data is padded out.
+	if(k < old && !inode_release(inumber, inode, base + k, base + old))
+		k = old;
+	if(k > 0 && inode_map(inumber, inode, base, k, blocks, 1) < k)
+	{
+		if(k > old)
+			inode_release(inumber, inode, base + old, base + k);
+		free(packed);
+		return 0;
+	}
+	if(k > 0 && k < CHUNK_BLOCKS)
+	{
+		memcpy(packed, &clen, sizeof(clen));
+		memset(&packed[sizeof(clen) + clen], 0, k*BYTES_PER_BLOCK - sizeof(clen) - clen);
+		src = packed;
+	}
+	// Written back rather than through, since a run of small writes
+	// rewrites the same chunk again and again
+	for(i = 0; i < k; i++)
+		cache_write(blocks[i], &src[i*BYTES_PER_BLOCK]);
+	free(packed);
+	return 1;
+}
+
+// Zero bytes from..to-1 of a compressed file, all within one chunk.
+static int chunk_zero( int inumber, struct fs_inode *inode, int64_t from, int64_t to )
+{
+	int64_t c = from/CHUNK_BYTES;
+	int ok;
+
+	if(from >= to)
+		return 1;
+	char *buf = malloc(CHUNK_BYTES);
+	if(!buf)
+	{
+		printf("Error Writing: Couldn't allocate a chunk buffer.\n");
+		return 0;
+	}
+	ok = chunk_read(inumber, inode, c, buf);
+	if(ok)
+	{
+		memset(&buf[from - c*CHUNK_BYTES], 0, to - from);
+		ok = chunk_write(inumber, inode, c, buf);
+	}
+	free(buf);
+	return ok;
+}
+
+// Only the chunks the transfer touches are decompressed; a whole one goes
+// straight into the caller's buffer.
+static int compressed_read( int inumber, struct fs_inode *inode, char *data, int length, int64_t offset )
+{
+	char *buf = malloc(CHUNK_BYTES);
+	int64_t c;
+	int done = 0;
+
+	if(!buf)
+	{
+		printf("Error Reading: Couldn't allocate a chunk buffer.\n");
+		return 0;
+	}
+	for(c = offset/CHUNK_BYTES; done < length; c++)
+	{
+		int from = (done ? 0 : offset % CHUNK_BYTES);
+		int n = (length - done < CHUNK_BYTES - from ? length - done : CHUNK_BYTES - from);
+		if(n == CHUNK_BYTES)
+		{
+			if(!chunk_read(inumber, inode, c, &data[done]))
+				break;
+		}
+		else
+		{
+			if(!chunk_read(inumber, inode, c, buf))
+				break;
+			memcpy(&data[done], &buf[from], n);
+		}
+		done += n;
+	}
+	free(buf);
+	return done;
+}
+
+// A chunk the write covers only in part is read, merged and compressed
+// again. Returns the bytes written.
+static int compressed_write( int inumber, struct fs_inode *inode, const char *data, int length, int64_t offset )
+{
+	char *buf = malloc(CHUNK_BYTES);
+	int64_t c;
+	int done = 0;
+
+	if(!buf)
+	{
+		printf("Error Writing: Couldn't allocate a chunk buffer.\n");
+		return 0;
+	}
+	for(c = offset/CHUNK_BYTES; done < length; c++)
+	{
+		int from = (done ? 0 : offset % CHUNK_BYTES);
+		int n = (length - done < CHUNK_BYTES - from ? length - done : CHUNK_BYTES - from);
+		const char *src = &data[done];
+		if(n < CHUNK_BYTES)
+		{
+			if(c*CHUNK_BYTES >= inode->size)
+				memset(buf, 0, CHUNK_BYTES);
+			else if(!chunk_read(inumber, inode, c, buf))
+				break;
+			memcpy(&buf[from], &data[done], n);
+			src = buf;
+		}
+		if(!chunk_write(inumber, inode, c, src))
+			break;
+		done += n;
+	}
+	free(buf);
+	return done;
+}
+
+static int inode_read( int inumber, char *data, int length, int64_t offset )
+{
+	if(!fs_mounted)
+	{
+		printf("No mounted filesystem found\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = inode_get(inumber);
+	if(!inode){
+		printf("Read Error: Invalid inumber\n");
+		return 0;
+	}
+
+	if(!inode->isvalid)
+	{
+		printf("Error Reading: The inode is invalid\n");
+		return 0;
+	}
+
+	if(inode->flags & INODE_DIR)
+	{
+		printf("Error Reading: The inode is a directory\n");
+		return 0;
+	}
+
+	int64_t size = inode->size;
+	if(offset < 0 || offset >= size || length <= 0)
+		return 0;
+	if(length > size - offset)
+		length = size - offset;
+
+	// The inode block is already resident, so there is nothing to read.
+	if(inode->flags & INODE_INLINE)
+	{
+		memcpy(data, &inline_data(inode)[offset], length);
+		return length;
+	}
+
+	if(inode->flags & INODE_COMPRESSED)
+	{
+		int read = compressed_read(inumber, inode, data, length, offset);
+		int64_t last = ((offset + length - 1)/CHUNK_BYTES + 1)*CHUNK_BLOCKS - 1;
+		readahead(inumber, inode, offset/BYTES_PER_BLOCK, last, offset + read);
+		return read;
+	}
+
+	int first = offset/BYTES_PER_BLOCK;
+	int count = (offset + length - 1)/BYTES_PER_BLOCK - first + 1;
+	int *blocks = malloc(count * sizeof(int));
+	if(!blocks)
+	{
+		printf("Read Error: Couldn't allocate the block list.\n");
+		return 0;
+	}
+	int mapped = inode_map(inumber, inode, first, count, blocks, 0);
+	if(mapped < count)
+		length = (int64_t)(first + mapped)*BYTES_PER_BLOCK - offset;
+
+	// Each physically contiguous run is read with one call, whole blocks
+	// straight into the caller's buffer and partial ones through a bounce
+	// block. Holes are zero filled without any I/O.
+	union fs_block bounce[2];
+	char *bufs[MAX_RUN_BLOCKS];
+	int k = 0;
+	while(k < mapped)
+	{
+		int run;
+		int64_t start;
+		int from, to;
+		int i;
+		if(!blocks[k])
+		{
+			transfer_span(offset, length, first + k, &start, &from, &to);
+			memset(&data[start + from], 0, to - from);
+			k++;
+			continue;
+		}
+		run = run_length(&blocks[k], mapped - k);
+		for(i = 0; i < run; i++)
+		{
+			if(transfer_span(offset, length, first + k + i, &start, &from, &to))
+				bufs[i] = &data[start];
+			else
+				bufs[i] = (start < 0 ? bounce[0].data : bounce[1].data);
+		}
+		cache_readv(blocks[k], run, bufs);
+
+		for(i = 0; i < run; i++)
+		{
+			if(!transfer_span(offset, length, first + k + i, &start, &from, &to))
+				memcpy(&data[start + from], &bufs[i][from], to - from);
+		}
+		k += run;
+	}
+
+	free(blocks);
+	int read = (length > 0 ? length : 0);
+	readahead(inumber, inode, first, first + count - 1, offset + read);
+	return read;
+}
+
+int fs_read( int inumber, char *data, int length, int64_t offset )
+{
+	int64_t start = stats_start();
+	inode_rdlock(inumber);
+	int result = inode_read(inumber, data, length, offset);
+	inode_unlock(inumber);
+	stats_record(STATS_FS_READ, start, result);
+	return result;
+}
+
+// Move the contents of an inline file out to its first data block, making
+// it an ordinary file. Returns 0 if no block could be allocated.
+static int inline_spill( int inumber, struct fs_inode *inode )
+{
+	union fs_block block;
+	int blocknum;
+
+	memset(block.data, 0, BYTES_PER_BLOCK);
+	memcpy(block.data, inline_data(inode), INLINE_DATA_BYTES);
+	memset(inline_data(inode), 0, INLINE_DATA_BYTES);
+	inode->flags &= ~INODE_INLINE;
+	inode_dirty(inumber);
+	if(inode->size == 0)
+		return 1;
+
+	if(inode_map(inumber, inode, 0, 1, &blocknum, 1) < 1)
+	{
+		memcpy(inline_data(inode), block.data, INLINE_DATA_BYTES);
+		inode->flags |= INODE_INLINE;
+		return 0;
+	}
+	cache_write(blocknum, block.data);
+	return 1;
+}
+
+static int inode_write( int inumber, const char *data, int length, int64_t offset )
+{
+	// Check Mounted
+	if(!fs_mounted)
+	{
+		printf("No mounted filesystem found\n");
+		return 0;
+	}
+
+	// Check Inumber
+	struct fs_inode *inode = inode_get(inumber);
+	if(!inode){
+		printf("Write Error: Invalid inumber\n");
+		return 0;
+	}
+
+	if(!inode->isvalid)
+	{
+		printf("Error Writing: The inode is invalid\n");
+		return 0;
+	}
+	if(inode->flags & INODE_DIR)
+	{
+		printf("Error Writing: The inode is a directory\n");
+		return 0;
+	}
+	if(length <= 0 || offset < 0)
+		return 0;
+
+	if(inode->flags & INODE_INLINE)
+	{
+		if(offset + length <= INLINE_DATA_BYTES)
+		{
+			memcpy(&inline_data(inode)[offset], data, length);
+			if(offset + length > inode->size)
+				inode->size = offset + length;
+			inode_dirty(inumber);
+			return length;
+		}
+		if(!inline_spill(inumber, inode))
+			return 0;
+	}
+
+	// Writing past the end of the file leaves a hole before the new data
+	int64_t size = inode->size;
+	int64_t nblocks = size_blocks(size);
+	int64_t limit = inode_max_size(inode);
+	if(offset >= limit)
+		return 0;
+	if(length > limit - offset)
+		length = limit - offset;
+
+	if(inode->flags & INODE_COMPRESSED)
+	{
+		int written = compressed_write(inumber, inode, data, length, offset);
+		if(written > 0 && offset + written > size)
+		{
+			inode->size = offset + written;
+			inode_dirty(inumber);
+		}
+		return written;
+	}
+
+	int first = offset/BYTES_PER_BLOCK;
+	int count = (offset + length - 1)/BYTES_PER_BLOCK - first + 1;
+	int last = first + count - 1;
+	int headBlock = 0;
+	int tailBlock = 0;
+	if(offset % BYTES_PER_BLOCK || (count == 1 && length < BYTES_PER_BLOCK))
+		inode_map(inumber, inode, first, 1, &headBlock, 0);
+	if(count > 1 && (offset + length) % BYTES_PER_BLOCK)
+		inode_map(inumber, inode, last, 1, &tailBlock, 0);
+
+	int *blocks = malloc(count * sizeof(int));
+	if(!blocks)
+	{
+		printf("Write Error: Couldn't allocate the block list.\n");
+		return 0;
+	}
+	int mapped = inode_map(inumber, inode, first, count, blocks, 1);
+	if(mapped < count)
+		length = (int64_t)(first + mapped)*BYTES_PER_BLOCK - offset;
+	if(mapped > 0 && first + mapped > nblocks)
+		inode_dirty(inumber);
+
+	// Each physically contiguous run of whole blocks is written through with
+	// one call straight from the caller's buffer. A partial head or tail
+	// block is merged into its cached copy instead; one that was a hole
+	// starts out zeroed.
+	const char *bufs[MAX_RUN_BLOCKS];
+	int k = 0;
+	while(k < mapped)
+	{
+		int run = run_length(&blocks[k], mapped - k);
+		int lo = 0;
+		int hi = run;
+		int64_t start;
+		int from, to;
+		int i;
+		if(!transfer_span(offset, length, first + k, &start, &from, &to))
+		{
+			cache_update(blocks[k], &data[start + from], from, to - from, (first + k == first ? !headBlock : !tailBlock));
+			lo++;
+		}
+		if(hi > lo && !transfer_span(offset, length, first + k + hi - 1, &start, &from, &to))
+		{
+			hi--;
+			cache_update(blocks[k + hi], &data[start + from], from, to - from, (first + k + hi == first ? !headBlock : !tailBlock));
+		}
+		for(i = lo; i < hi; i++)
+		{
+			transfer_span(offset, length, first + k + i, &start, &from, &to);
+			bufs[i - lo] = &data[start];
+		}
+		if(hi > lo)
+			cache_writev(blocks[k + lo], hi - lo, bufs);
+		k += run;
+	}
+
+	free(blocks);
+	int written = (length > 0 ? length : 0);
+
+	// A write that failed outright leaves the size alone, even past the end
+	if(written > 0 && offset + written > size){
+		inode->size = offset + written;
+		inode_dirty(inumber);
+	}
+	return written;
+}
+
+int fs_write( int inumber, const char *data, int length, int64_t offset )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	inode_wrlock(inumber);
+	int result = inode_write(inumber, data, length, offset);
+	inode_unlock(inumber);
+	gate_leave();
+	stats_record(STATS_FS_WRITE, start, result);
+	if(result > 0)
+		commit_note();
+	return result;
+}
+
+
+// Zero bytes from..to-1 of the file, all within one block, unless that
+// block is a hole.
+static void block_zero( int inumber, struct fs_inode *inode, int64_t from, int64_t to )
+{
+	union fs_block zeros;
+	int blocknum = 0;
+
+	if(from >= to)
+		return;
+	inode_map(inumber, inode, from/BYTES_PER_BLOCK, 1, &blocknum, 0);
+	if(blocknum)
+	{
+		memset(zeros.data, 0, BYTES_PER_BLOCK);
+		cache_update(blocknum, zeros.data, from % BYTES_PER_BLOCK, to - from, 0);
+	}
+}
+
+// Look up a file for a call that changes it, or NULL.
+static struct fs_inode *inode_get_file( int inumber, const char *what )
+{
+	if(!fs_mounted)
+	{
+		printf("No mounted filesystem found\n");
+		return NULL;
+	}
+
+	struct fs_inode *inode = inode_get(inumber);
+	if(!inode){
+		printf("%s Error: Invalid inumber\n", what);
+		return NULL;
+	}
+	if(!inode->isvalid || (inode->flags & INODE_DIR))
+	{
+		printf("%s Error: The inode is not a valid file\n", what);
+		return NULL;
+	}
+	return inode;
+}
+
+// Bytes past the end of a file always read as zeros, whether or not there
+// is a block behind them, so a file can be grown again without revealing
+// what it held before.
+static int inode_truncate( int inumber, int64_t size )
+{
+	struct fs_inode *inode = inode_get_file(inumber, "Truncate");
+	if(!inode)
+		return 0;
+	if(size < 0 || size > inode_max_size(inode))
+	{
+		printf("Truncate Error: Invalid size\n");
+		return 0;
+	}
+
+	if(inode->flags & INODE_INLINE)
+	{
+		if(size <= INLINE_DATA_BYTES)
+		{
+			if(size < inode->size)
+				memset(&inline_data(inode)[size], 0, inode->size - size);
+			inode->size = size;
+			inode_dirty(inumber);
+			return 1;
+		}
+		if(!inline_spill(inumber, inode))
+			return 0;
+	}
+
+	if(size < inode->size && (inode->flags & INODE_COMPRESSED))
+	{
+		int64_t end = (size + CHUNK_BYTES - 1)/CHUNK_BYTES*CHUNK_BYTES;
+		if(!inode_release(inumber, inode, end/BYTES_PER_BLOCK, MAX_FILE_BLOCKS) || !chunk_zero(inumber, inode, size, end))
+			return 0;
+		stream_drop(inumber);
+	}
+	else if(size < inode->size)
+	{
+		if(!inode_release(inumber, inode, size_blocks(size), MAX_FILE_BLOCKS))
+			return 0;
+		if(size % BYTES_PER_BLOCK)
+			block_zero(inumber, inode, size, (size/BYTES_PER_BLOCK + 1)*BYTES_PER_BLOCK);
+		stream_drop(inumber);
+	}
+	inode->size = size;
+	inode_dirty(inumber);
+	return 1;
+}
+
+// Blocks wholly inside the range are freed, parts of blocks zeroed. The
+// size stays the same.
+static int inode_punch( int inumber, int64_t offset, int64_t length )
+{
+	struct fs_inode *inode = inode_get_file(inumber, "Punch");
+	if(!inode)
+		return 0;
+	if(offset < 0 || length < 0)
+	{
+		printf("Punch Error: Invalid range\n");
+		return 0;
+	}
+
+	int64_t size = inode->size;
+	int64_t end = (length > size - offset ? size : offset + length);
+	if(offset >= end)
+		return 1;
+
+	if(inode->flags & INODE_INLINE)
+	{
+		memset(&inline_data(inode)[offset], 0, end - offset);
+		inode_dirty(inumber);
+		return 1;
+	}
+
+	// Compressed files are punched a chunk at a time in the same way
+	if(inode->flags & INODE_COMPRESSED)
+	{
+		int64_t first = (offset + CHUNK_BYTES - 1)/CHUNK_BYTES;
+		int64_t last = (end == size ? (size + CHUNK_BYTES - 1)/CHUNK_BYTES : end/CHUNK_BYTES);
+		if(first > last)
+			return chunk_zero(inumber, inode, offset, end);
+		if(!chunk_zero(inumber, inode, offset, first*CHUNK_BYTES))
+			return 0;
+		if(end < size && !chunk_zero(inumber, inode, last*CHUNK_BYTES, end))
+			return 0;
+		return inode_release(inumber, inode, first*CHUNK_BLOCKS, last*CHUNK_BLOCKS);
+	}
+
+	// The block holding the end of the file is whole as far as the range
+	// is concerned, since the rest of it is past the end.
+	int64_t first = size_blocks(offset);
+	int64_t last = (end == size ? size_blocks(size) : end/BYTES_PER_BLOCK);
+	if(first > last)
+	{
+		block_zero(inumber, inode, offset, end);
+		return 1;
+	}
+	// Release first, so a punch the extent list can't take changes nothing
+	if(!inode_release(inumber, inode, first, last))
+		return 0;
+	block_zero(inumber, inode, offset, first*BYTES_PER_BLOCK);
+	if(end < size)
+		block_zero(inumber, inode, last*BYTES_PER_BLOCK, end);
+	return 1;
+}
+
+int fs_truncate( int inumber, int64_t size )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	inode_wrlock(inumber);
+	int result = inode_truncate(inumber, size);
+	inode_unlock(inumber);
+	gate_leave();
+	stats_record(STATS_FS_TRUNCATE, start, 0);
+	if(result)
+		commit_note();
+	return result;
+}
+
+int fs_punch( int inumber, int64_t offset, int64_t length )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	inode_wrlock(inumber);
+	int result = inode_punch(inumber, offset, length);
+	inode_unlock(inumber);
+	gate_leave();
+	stats_record(STATS_FS_PUNCH, start, 0);
+	if(result)
+		commit_note();
+	return result;
+}
+
+// Only an empty file can change mode, so there is nothing to convert.
+static int inode_set_compression( int inumber, int on )
+{
+	struct fs_inode *inode = inode_get_file(inumber, "Compress");
+	if(!inode)
+		return 0;
+	if(!(inode->flags & INODE_COMPRESSED) == !on)
+		return 1;
+	if(inode->size != 0)
+	{
+		printf("Compress Error: The file is not empty\n");
+		return 0;
+	}
+
+	// Each chunk that compresses leaves a hole after it, which would split
+	// an extent list into two extents a chunk.
+	if(on && fs_extents())
+	{
+		printf("Compress Error: Compression is not supported on an extent-format filesystem\n");
+		return 0;
+	}
+
+	if(inode->flags & INODE_INLINE)
+		memset(inline_data(inode), 0, INLINE_DATA_BYTES);
+	inode->flags &= ~(INODE_INLINE | INODE_COMPRESSED);
+	if(on)
+		inode->flags |= INODE_COMPRESSED;
+	inode_dirty(inumber);
+	return 1;
+}
+
+int fs_set_compression( int inumber, int on )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	inode_wrlock(inumber);
+	int result = inode_set_compression(inumber, on);
+	inode_unlock(inumber);
+	gate_leave();
+	stats_record(STATS_FS_COMPRESS, start, 0);
+	if(result)
+		commit_note();
+	return result;
+}
+
+// Lock two inodes, in stripe order so that two callers can't deadlock.
+// Inodes sharing a stripe take it once.
+static void inode_wrlock_pair( int a, int b )
+{
+	unsigned x = (unsigned)a % INODE_LOCKS;
+	unsigned y = (unsigned)b % INODE_LOCKS;
+	inode_wrlock(x < y ? x : y);
+	if(x != y)
+		inode_wrlock(x < y ? y : x);
+}
+
+static void inode_unlock_pair( int a, int b )
+{
+	inode_unlock(a);
+	if((unsigned)a % INODE_LOCKS != (unsigned)b % INODE_LOCKS)
+		inode_unlock(b);
+}
+
+// FNV-1a
+static unsigned name_hash( const char *name )
+{
+	unsigned hash = 2166136261u;
+	while(*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	return hash;
+}
+
+static _Bool dir_valid( struct fs_inode *inode )
+{
+	return inode && inode->isvalid && (inode->flags & INODE_DIR);
+}
+
+// Read or write logical block l of a directory. Writing the block past the
+// end grows the directory by one block. Return 0 on failure.
+static int dir_read( int dir, struct fs_inode *inode, int l, union fs_block *block )
+{
+	int blocknum;
+	if(l < 0 || l >= size_blocks(inode->size) || inode_map(dir, inode, l, 1, &blocknum, 0) < 1)
+	{
+		printf("Directory Error: Invalid directory block detected in Filesystem.\n");
+		return 0;
+	}
+	cache_read(blocknum, block->data);
+	return 1;
+}
+
+static int dir_write( int dir, struct fs_inode *inode, int l, union fs_block *block )
+{
+	int blocknum;
+	if(inode_map(dir, inode, l, 1, &blocknum, 1) < 1)
+		return 0;
+	if((int64_t)(l + 1)*BYTES_PER_BLOCK > inode->size)
+	{
+		inode->size = (int64_t)(l + 1)*BYTES_PER_BLOCK;
+		inode_dirty(dir);
+	}
+	meta_write(blocknum, block->data);
+	return 1;
+}
+
+// Turn an inode into an empty directory: an index whose one slot points at
+// one empty leaf.
+static int dir_init( int dir, struct fs_inode *inode )
+{
+	union fs_block block;
+
+	memset(inline_data(inode), 0, inode_size() - offsetof(struct fs_inode, direct));
+	inode->isvalid = 1;
+	inode->flags = INODE_DIR;
+	inode->size = 0;
+	inode_dirty(dir);
+
+	memset(block.data, 0, BYTES_PER_BLOCK);
+	block.dirindex.leaf[0] = 1;
+	if(!dir_write(dir, inode, 0, &block))
+		return 0;
+	memset(block.data, 0, BYTES_PER_BLOCK);
+	return dir_write(dir, inode, 1, &block);
+}
+
+// Find name in a directory, leaving its index in index and the leaf it
+// belongs in, block l, in leaf. *x is set to the block of the index with
+// the leaf's slot: 0, or that of a second level index. Returns the entry's
+// slot in the leaf, or -1 if it isn't there.
+static int dir_find( int dir, struct fs_inode *inode, const char *name, union fs_block *index, union fs_block *leaf, int *x, int *l )
+{
+	unsigned hash = name_hash(name);
+	int i;
+
+	*x = 0;
+	*l = -1;
+	if(!dir_read(dir, inode, 0, index) || index->dirindex.depth < 0 || index->dirindex.depth > DIR_MAX_DEPTH)
+		return -1;
+	i = index->dirindex.leaf[hash & ((1u << index->dirindex.depth) - 1)];
+	if(i < 0)
+	{
+		// The leaf buffer holds the second level index until the leaf is read
+		struct fs_dirindex *sub = &leaf->dirindex;
+		*x = -i;
+		if(!dir_read(dir, inode, *x, leaf) || sub->nentries != DIR_SUBINDEX || sub->depth < 0 || sub->depth > DIR_MAX_DEPTH)
+			return -1;
+		i = sub->leaf[(hash >> DIR_MAX_DEPTH) & ((1u << sub->depth) - 1)];
+	}
+	if(i < 1 || !dir_read(dir, inode, i, leaf))
+		return -1;
+	*l = i;
+	for(i = 0; i < leaf->dirleaf.count && i < DIRENTS_PER_BLOCK; i++)
+	{
+		if(!strcmp(leaf->dirleaf.entry[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+// Split full leaf l in two on its next hash bit, into a new block at the
+// end of the directory. index is the index with the leaf's slot, block x,
+// over the hash bits from shift up.
+static int dir_split( int dir, struct fs_inode *inode, union fs_block *index, int x, int shift, union fs_block *leaf, int l )
+{
+	struct fs_dirindex *xi = &index->dirindex;
+	struct fs_dirleaf *old = &leaf->dirleaf;
+	union fs_block block;
+	struct fs_dirleaf *split = &block.dirleaf;
+	int newl = size_blocks(inode->size);
+	int bit;
+	int i;
+	int n = 0;
+
+	if(old->depth - shift == xi->depth)
+	{
+		if(xi->depth == DIR_MAX_DEPTH)
+		{
+			printf("Directory Error: The directory is full\n");
+			return 0;
+		}
+		memcpy(&xi->leaf[1 << xi->depth], xi->leaf, (1 << xi->depth)*sizeof(int));
+		xi->depth++;
+	}
+
+	bit = 1 << (old->depth - shift);
+	memset(block.data, 0, BYTES_PER_BLOCK);
+	old->depth++;
+	split->depth = old->depth;
+	for(i = 0; i < old->count; i++)
+	{
+		if((name_hash(old->entry[i].name) >> shift) & bit)
+			split->entry[split->count++] = old->entry[i];
+		else
+			old->entry[n++] = old->entry[i];
+	}
+	memset(&old->entry[n], 0, (old->count - n)*sizeof(struct fs_dirent));
+	old->count = n;
+	for(i = 0; i < (1 << xi->depth); i++)
+	{
+		if(xi->leaf[i] == l && (i & bit))
+			xi->leaf[i] = newl;
+	}
+
+	// Until the old leaf is written both hold the moved names, so a crash
+	// part way through loses none of them.
+	return dir_write(dir, inode, newl, &block) && dir_write(dir, inode, x, index) && dir_write(dir, inode, l, leaf);
+}
+
+// Give full leaf l, as deep as the full first level index, a second level
+// index of its own, in a new block at the end of the directory. The index
+// is written last, so until then the new block is only an unused one.
+static int dir_deepen( int dir, struct fs_inode *inode, union fs_block *index, const char *name, int l )
+{
+	union fs_block block;
+	int newl = size_blocks(inode->size);
+
+	memset(block.data, 0, BYTES_PER_BLOCK);
+	block.dirindex.nentries = DIR_SUBINDEX;
+	block.dirindex.leaf[0] = l;
+	index->dirindex.leaf[name_hash(name) & ((1u << DIR_MAX_DEPTH) - 1)] = -newl;
+	return dir_write(dir, inode, newl, &block) && dir_write(dir, inode, 0, index);
+}
+
+static int dir_insert( int dir, struct fs_inode *inode, const char *name, int inumber, _Bool isdir )
+{
+	union fs_block index;
+	union fs_block leaf;
+	union fs_block sub;
+	struct fs_dirent *entry;
+	int ok;
+	int x;
+	int l;
+
+	for(;;)
+	{
+		if(dir_find(dir, inode, name, &index, &leaf, &x, &l) >= 0)
+		{
+			printf("Directory Error: %s already exists\n", name);
+			return 0;
+		}
+		if(l < 0)
+			return 0;
+		if(leaf.dirleaf.count < DIRENTS_PER_BLOCK)
+			break;
+		if(x > 0)
+			ok = dir_read(dir, inode, x, &sub) && dir_split(dir, inode, &sub, x, DIR_MAX_DEPTH, &leaf, l);
+		else if(leaf.dirleaf.depth == DIR_MAX_DEPTH)
+			ok = dir_deepen(dir, inode, &index, name, l);
+		else
+			ok = dir_split(dir, inode, &index, 0, 0, &leaf, l);
+		if(!ok)
+			return 0;
+	}
+
+	entry = &leaf.dirleaf.entry[leaf.dirleaf.count++];
+	entry->inumber = inumber;
+	entry->isdir = isdir;
+	strcpy(entry->name, name);
+	index.dirindex.nentries++;
+	return dir_write(dir, inode, l, &leaf) && dir_write(dir, inode, 0, &index);
+}
+
+// Remove entry i of leaf l, as found by dir_find.
+static int dir_remove( int dir, struct fs_inode *inode, union fs_block *index, union fs_block *leaf, int l, int i )
+{
+	struct fs_dirleaf *x = &leaf->dirleaf;
+
+	x->entry[i] = x->entry[--x->count];
+	memset(&x->entry[x->count], 0, sizeof(struct fs_dirent));
+	index->dirindex.nentries--;
+	return dir_write(dir, inode, l, leaf) && dir_write(dir, inode, 0, index);
+}
+
+// Visit every entry, leaf by leaf, passing over second level indexes.
+// Returns the number visited, or -1.
+static int dir_list( int dir, struct fs_inode *inode, fs_dirent_callback visit, void *arg )
+{
+	union fs_block leaf;
+	int64_t nblocks = size_blocks(inode->size);
+	int n = 0;
+	int l;
+	int i;
+
+	for(l = 1; l < nblocks; l++)
+	{
+		if(!dir_read(dir, inode, l, &leaf))
+			return -1;
+		if(leaf.dirleaf.count == DIR_SUBINDEX)
+			continue;
+		for(i = 0; i < leaf.dirleaf.count && i < DIRENTS_PER_BLOCK; i++, n++)
+		{
+			if(visit)
+				visit(arg, leaf.dirleaf.entry[i].name, leaf.dirleaf.entry[i].inumber, leaf.dirleaf.entry[i].isdir);
+		}
+	}
+	return n;
+}
+
+// Look name up in directory dir, or -1.
+static int dir_lookup( int dir, const char *name )
+{
+	union fs_block index;
+	union fs_block leaf;
+	int result = -1;
+	int x;
+	int l;
+	int i;
+
+	inode_rdlock(dir);
+	struct fs_inode *inode = inode_get(dir);
+	if(dir_valid(inode) && (i = dir_find(dir, inode, name, &index, &leaf, &x, &l)) >= 0)
+		result = leaf.dirleaf.entry[i].inumber;
+	inode_unlock(dir);
+	return result;
+}
+
+// Copy the next component of *path into name, skipping slashes. Returns 0
+// at the end of the path and -1 if the component is too long.
+static int path_next( const char **path, char *name )
+{
+	int n = 0;
+
+	while(**path == '/')
+		(*path)++;
+	while(**path && **path != '/')
+	{
+		if(n == FS_NAME_MAX)
+			return -1;
+		name[n++] = *(*path)++;
+	}
+	name[n] = 0;
+	return n > 0;
+}
+
+// Walk every component of path but the last, which is left in name (empty
+// for the root). Returns the directory holding it, or -1.
+static int path_parent( const char *path, char *name )
+{
+	char next[FS_NAME_MAX+1];
+	const char *rest = path;
+	int dir = 0;
+	int more;
+
+	if(!fs_mounted)
+	{
+		printf("No mounted filesystem found\n");
+		return -1;
+	}
+	if(path[0] != '/' || (more = path_next(&rest, name)) < 0)
+	{
+		printf("Path Error: %s is not an absolute path of names up to %d bytes\n", path, FS_NAME_MAX);
+		return -1;
+	}
+	while(more > 0)
+	{
+		more = path_next(&rest, next);
+		if(more < 0)
+		{
+			printf("Path Error: A name is longer than %d bytes\n", FS_NAME_MAX);
+			return -1;
+		}
+		if(more == 0)
+			break;
+		dir = dir_lookup(dir, name);
+		if(dir < 0)
+			return -1;
+		strcpy(name, next);
+	}
+	return dir;
+}
+
+static int path_lookup( const char *path )
+{
+	char name[FS_NAME_MAX+1];
+	int dir = path_parent(path, name);
+	if(dir < 0 || !name[0])
+		return dir;
+	return dir_lookup(dir, name);
+}
+
+// Make a file or directory and give it a name. Returns its inumber or 0.
+static int path_create( const char *path, _Bool isdir )
+{
+	char name[FS_NAME_MAX+1];
+	int dir = path_parent(path, name);
+	int ok = 0;
+
+	if(dir < 0)
+		return 0;
+	if(!name[0])
+	{
+		printf("Directory Error: / already exists\n");
+		return 0;
+	}
+
+	int i = inode_create();
+	if(!i)
+		return 0;
+	inode_wrlock(i);
+	if(isdir)
+		ok = dir_init(i, inode_get(i));
+	// Flagged before the name exists, so fs_delete can't take it meanwhile
+	inode_get(i)->flags |= INODE_NAMED;
+	inode_dirty(i);
+	inode_unlock(i);
+
+	if(ok || !isdir)
+	{
+		inode_wrlock(dir);
+		struct fs_inode *inode = inode_get(dir);
+		if(dir == 0 && inode && !inode->isvalid && !dir_init(0, inode))
+			ok = 0;
+		else if(!dir_valid(inode))
+			printf("Directory Error: The parent of %s is not a directory\n", name);
+		else
+			ok = dir_insert(dir, inode, name, i, isdir);
+		inode_unlock(dir);
+	}
+
+	if(!ok)
+	{
+		inode_wrlock(i);
+		inode_get(i)->flags &= ~(INODE_DIR | INODE_NAMED);
+		inode_delete(i);
+		inode_unlock(i);
+		return 0;
+	}
+	return i;
+}
+
+// Take a name away and delete its inode; a directory has to be empty.
+static int path_remove( const char *path, _Bool isdir )
+{
+	char name[FS_NAME_MAX+1];
+	union fs_block index;
+	union fs_block leaf;
+	union fs_block child;
+	int dir = path_parent(path, name);
+	int ok = 0;
+	int i;
+	int x;
+	int l;
+	int slot;
+
+	if(dir < 0)
+		return 0;
+	if(!name[0])
+	{
+		printf("Directory Error: Can't remove /\n");
+		return 0;
+	}
+	i = dir_lookup(dir, name);
+	if(i < 0)
+	{
+		printf("Directory Error: %s not found\n", path);
+		return 0;
+	}
+
+	inode_wrlock_pair(dir, i);
+	struct fs_inode *parent = inode_get(dir);
+	struct fs_inode *inode = inode_get(i);
+	if(!dir_valid(parent) || (slot = dir_find(dir, parent, name, &index, &leaf, &x, &l)) < 0 || leaf.dirleaf.entry[slot].inumber != i)
+		printf("Directory Error: %s was removed meanwhile\n", path);
+	else if(!inode)
+		printf("Directory Error: %s names an invalid inode\n", path);
+	else if(isdir != dir_valid(inode))
+		printf("Directory Error: %s is %sa directory\n", path, isdir ? "not " : "");
+	else if(isdir && (!dir_read(i, inode, 0, &child) || child.dirindex.nentries != 0))
+		printf("Directory Error: %s is not empty\n", path);
+	else if(dir_remove(dir, parent, &index, &leaf, l, slot))
+	{
+		inode->flags &= ~(INODE_DIR | INODE_NAMED);
+		ok = inode_delete(i);
+	}
+	inode_unlock_pair(dir, i);
+	return ok;
+}
+
+int fs_lookup( const char *path )
+{
+	int64_t start = stats_start();
+	int result = path_lookup(path);
+	stats_record(STATS_FS_LOOKUP, start, 0);
+	return result;
+}
+
+int fs_create_path( const char *path )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	int result = path_create(path, 0);
+	gate_leave();
+	stats_record(STATS_FS_CREATE, start, 0);
+	if(result > 0)
+		commit_note();
+	return result;
+}
+
+int fs_mkdir( const char *path )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	int result = path_create(path, 1) > 0;
+	gate_leave();
+	stats_record(STATS_FS_MKDIR, start, 0);
+	if(result)
+		commit_note();
+	return result;
+}
+
+int fs_rmdir( const char *path )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	int result = path_remove(path, 1);
+	gate_leave();
+	stats_record(STATS_FS_RMDIR, start, 0);
+	if(result)
+		commit_note();
+	return result;
+}
+
+int fs_unlink( const char *path )
+{
+	int64_t start = stats_start();
+	gate_enter();
+	int result = path_remove(path, 0);
+	gate_leave();
+	stats_record(STATS_FS_UNLINK, start, 0);
+	if(result)
+		commit_note();
+	return result;
+}
+
+int fs_readdir( const char *path, fs_dirent_callback visit, void *arg )
+{
+	int64_t start = stats_start();
+	int result = -1;
+	int dir = path_lookup(path);
+	if(dir >= 0)
+	{
+		inode_rdlock(dir);
+		struct fs_inode *inode = inode_get(dir);
+		if(dir_valid(inode))
+			result = dir_list(dir, inode, visit, arg);
+		else if(dir == 0 && inode && !inode->isvalid)
+			result = 0;
+		else
+			printf("Directory Error: %s is not a directory\n", path);
+		inode_unlock(dir);
+	}
+	stats_record(STATS_FS_READDIR, start, 0);
+	return result;
+}
+
+void fs_set_prealloc( int nblocks )
+{
+	preallocBlocks = (nblocks > 1 ? nblocks : 1);
+}
+
+void fs_set_readahead( int nblocks )
+{
+	readaheadBlocks = (nblocks > 0 ? nblocks : 0);
+}
+
+void fs_set_commit_interval( int nupdates )
+{
+	commitInterval = (nupdates > 0 ? nupdates : 0);
 }
@@ -1,15 +1,71 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdint.h>
+
+#define FS_FORMAT_EXTENTS 1
+#define FS_FORMAT_JOURNAL 2
+#define FS_FORMAT_INLINE  4
+
+#define FS_DEFAULT_PREALLOC 64
+#define FS_DEFAULT_READAHEAD 64
+
+#define FS_NAME_MAX 58
+
 void fs_debug();
-int  fs_format();
+int  fs_format( int flags );
 int  fs_mount();
+int  fs_unmount();
+int  fs_check();
 
+// The calls below may be made from several threads at once.
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
+int64_t fs_getsize( int inumber );
+
+int  fs_read( int inumber, char *data, int length, int64_t offset );
+int  fs_write( int inumber, const char *data, int length, int64_t offset );
+
+// Files are sparse: a write past the end leaves a hole, and holes take no
+// blocks and read as zeros. fs_truncate sets the size, freeing any blocks
+// past it. fs_punch frees the blocks inside a range, zeroing the bytes of
+// any block it only partly covers, and keeps the size. On a
+// FS_FORMAT_EXTENTS filesystem each hole and each run of blocks is an
+// extent, and a file holds at most 32,706 of them. fs_write stops at the
+// first block that would need more, returning what it wrote before it, and
+// fs_punch fails, returning 0, and changes nothing.
+int  fs_truncate( int inumber, int64_t size );
+int  fs_punch( int inumber, int64_t offset, int64_t length );
+
+// fs_set_compression turns compression on or off for an empty file. Its
+// contents are then compressed a few blocks at a time as they are written,
+// and a read decompresses only the chunks it touches. It fails on a
+// FS_FORMAT_EXTENTS filesystem.
+int  fs_set_compression( int inumber, int on );
+
+// Names. Paths are absolute, components are separated by '/' and hold at
+// most FS_NAME_MAX bytes. fs_lookup returns the inumber or -1, and
+// fs_create_path the new file's inumber or 0; the root directory is inode 0.
+// fs_delete refuses a file that has a name, which is removed with
+// fs_unlink instead. fs_readdir calls visit for each entry and returns how
+// many there were, or -1. A directory holds up to 262,144 leaf blocks of 63
+// names; it is only full once more than 63 names share the low 18 bits of
+// their hash, typically past several million names.
+typedef void (*fs_dirent_callback)( void *arg, const char *name, int inumber, int isdir );
+
+int  fs_lookup( const char *path );
+int  fs_create_path( const char *path );
+int  fs_mkdir( const char *path );
+int  fs_rmdir( const char *path );
+int  fs_unlink( const char *path );
+int  fs_readdir( const char *path, fs_dirent_callback visit, void *arg );
+
+// Returns once everything written before the call is on disk. Concurrent
+// calls share one commit.
+int  fs_sync();
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+void fs_set_prealloc( int nblocks );
+void fs_set_readahead( int nblocks );
+void fs_set_commit_interval( int nupdates );
 
 #endif
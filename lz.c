@@ -0,0 +1,144 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+static uint32_t load32( const unsigned char *p )
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Lengths that don't fit in a token nibble carry on in bytes of 255 and
+// a final byte under 255.
+static int put_length( unsigned char *out, int *op, int cap, int n )
+{
+	for(; n >= 255; n -= 255)
+	{
+		if(*op >= cap) return 0;
+		out[(*op)++] = 255;
+	}
+	if(*op >= cap) return 0;
+	out[(*op)++] = n;
+	return 1;
+}
+
+static int get_length( const unsigned char *in, int *ip, int n, int *length )
+{
+	int b;
+	do {
+		if(*ip >= n) return 0;
+		b = in[(*ip)++];
+		*length += b;
+	} while(b == 255);
+	return 1;
+}
+
+// Write one sequence: literals, then a match of length at offset back, or
+// no match at all for the last sequence (length 0).
+static int put_sequence( unsigned char *out, int *op, int cap, const unsigned char *literals, int nliterals, int offset, int length )
+{
+	int m = (length ? length - MIN_MATCH : 0);
+
+	if(*op >= cap) return 0;
+	out[(*op)++] = (nliterals < 15 ? nliterals : 15) << 4 | (m < 15 ? m : 15);
+	if(nliterals >= 15 && !put_length(out, op, cap, nliterals - 15))
+		return 0;
+	if(nliterals > cap - *op)
+		return 0;
+	memcpy(&out[*op], literals, nliterals);
+	*op += nliterals;
+	if(!length)
+		return 1;
+
+	if(2 > cap - *op) return 0;
+	out[(*op)++] = offset & 0xff;
+	out[(*op)++] = offset >> 8;
+	return m < 15 || put_length(out, op, cap, m - 15);
+}
+
+// Returns the compressed size, or 0 if it would be more than cap.
+int lz_compress( const char *src, int n, char *dst, int cap )
+{
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	int table[1 << HASH_BITS];
+	int ip = 0;
+	int anchor = 0;
+	int op = 0;
+
+	// Positions are stored plus one, so zero means empty
+	memset(table, 0, sizeof(table));
+	while(ip + MIN_MATCH <= n)
+	{
+		uint32_t seq = load32(&in[ip]);
+		int h = (seq * 2654435761u) >> (32 - HASH_BITS);
+		int ref = table[h] - 1;
+		table[h] = ip + 1;
+		if(ref < 0 || ip - ref > MAX_OFFSET || load32(&in[ref]) != seq)
+		{
+			// Skip faster through data that isn't matching
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		int length = MIN_MATCH;
+		while(ip + length < n && in[ref + length] == in[ip + length])
+			length++;
+		if(!put_sequence(out, &op, cap, &in[anchor], ip - anchor, ip - ref, length))
+			return 0;
+		ip += length;
+		anchor = ip;
+	}
+	if(!put_sequence(out, &op, cap, &in[anchor], n - anchor, 0, 0))
+		return 0;
+	return op;
+}
+
+// Returns the decompressed size, or -1 if src is corrupt or would
+// decompress to more than cap.
+int lz_decompress( const char *src, int n, char *dst, int cap )
+{
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	int ip = 0;
+	int op = 0;
+
+	while(ip < n)
+	{
+		int token = in[ip++];
+		int nliterals = token >> 4;
+		int length = (token & 15) + MIN_MATCH;
+		int offset;
+		int i;
+
+		if(nliterals == 15 && !get_length(in, &ip, n, &nliterals))
+			return -1;
+		if(nliterals > n - ip || nliterals > cap - op)
+			return -1;
+		memcpy(&out[op], &in[ip], nliterals);
+		ip += nliterals;
+		op += nliterals;
+		if(ip == n)
+			break;
+
+		if(2 > n - ip)
+			return -1;
+		offset = in[ip] | in[ip+1] << 8;
+		ip += 2;
+		if((token & 15) == 15 && !get_length(in, &ip, n, &length))
+			return -1;
+		if(offset == 0 || offset > op || length > cap - op)
+			return -1;
+		// Byte by byte, since a match may overlap its own output
+		for(i = 0; i < length; i++, op++)
+			out[op] = out[op - offset];
+	}
+	return op;
+}
@@ -0,0 +1,13 @@
+#ifndef LZ_H
+#define LZ_H
+
+// A small LZ77 codec in the style of LZ4: each sequence is a token byte
+// holding a literal count and a match length, the literals, then a two
+// byte offset back into the output. Matches are found with a hash table of
+// recent positions, so compression is one pass and decompression is a copy
+// loop.
+
+int  lz_compress( const char *src, int n, char *dst, int cap );
+int  lz_decompress( const char *src, int n, char *dst, int cap );
+
+#endif
@@ -0,0 +1,121 @@
+
+#include "disk.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Replays a block trace taken with disk_trace against a scratch image,
+// through a cache of the chosen size and the chosen disk backend, as fast
+// as it can. A trace taken with the cache disabled (-c 0 in the shell)
+// holds every block the filesystem asked for, so replaying it through
+// different cache sizes shows how each would have done.
+
+#define REPLAY_CHUNK 4096
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+int main( int argc, char *argv[] )
+{
+	struct disk_trace_header h;
+	struct disk_trace_record *records;
+	char data[DISK_BLOCK_SIZE];
+	int cacheblocks = CACHE_DEFAULT_BLOCKS;
+	int backend = DISK_BACKEND_PREAD;
+	int64_t nrecords = 0, blockreads = 0, blockwrites = 0;
+	int diskreads, diskwrites;
+	int opt, i, j, n, bad = 0;
+	double start, seconds;
+	FILE *file;
+
+	while((opt=getopt(argc,argv,"c:m"))!=-1) {
+		switch(opt) {
+		case 'c':
+			cacheblocks = atoi(optarg);
+			break;
+		case 'm':
+			backend = DISK_BACKEND_MMAP;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-m] [-c cacheblocks] <tracefile> <scratch diskfile>\n",argv[0]);
+		return 1;
+	}
+
+	file = fopen(argv[optind],"r");
+	if(!file) {
+		printf("couldn't open %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+	if(fread(&h,sizeof(h),1,file)!=1 || h.magic!=DISK_TRACE_MAGIC || h.blocksize!=DISK_BLOCK_SIZE) {
+		printf("%s is not a block trace\n",argv[optind]);
+		return 1;
+	}
+
+	if(!disk_init(argv[optind+1],h.nblocks,backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind+1],strerror(errno));
+		return 1;
+	}
+
+	if(!cache_init(cacheblocks)) {
+		printf("couldn't allocate a cache of %d blocks\n",cacheblocks);
+		return 1;
+	}
+
+	records = malloc(REPLAY_CHUNK*sizeof(struct disk_trace_record));
+	memset(data,0,sizeof(data));
+
+	start = now();
+	while((n = fread(records,sizeof(struct disk_trace_record),REPLAY_CHUNK,file)) > 0) {
+		for(i=0;i<n;i++) {
+			struct disk_trace_record *r = &records[i];
+			if(r->blocknum<0 || r->blocknum+r->count>h.nblocks) {
+				bad++;
+				continue;
+			}
+			for(j=0;j<r->count;j++) {
+				if(r->op==DISK_TRACE_WRITE) {
+					cache_write(r->blocknum+j,data);
+					blockwrites++;
+				} else {
+					cache_read(r->blocknum+j,data);
+					blockreads++;
+				}
+			}
+		}
+		nrecords += n;
+	}
+	cache_flush();
+	seconds = now()-start;
+	diskreads = disk_nreads();
+	diskwrites = disk_nwrites();
+
+	printf("%lld records replayed in %.3f seconds",(long long)nrecords,seconds);
+	if(bad) printf(" (%d out of range and skipped)",bad);
+	printf("\n");
+	printf("%lld block reads, %lld block writes requested\n",(long long)blockreads,(long long)blockwrites);
+	printf("%d disk block reads, %d disk block writes\n",diskreads,diskwrites);
+	printf("%.1f requests/s, %.2f MB/s\n",(blockreads+blockwrites)/seconds,
+		(blockreads+blockwrites)*(double)DISK_BLOCK_SIZE/seconds/(1024*1024));
+	printf("%.2f%% read hit rate\n",blockreads ? 100.0*(blockreads-diskreads)/blockreads : 0.0);
+
+	fclose(file);
+	free(records);
+	cache_close();
+	disk_close();
+	return 0;
+}
@@ -1,12 +1,18 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
+static int format_flags( char *options );
+static int resolve( const char *arg );
+static void do_ls( void *arg, const char *name, int inumber, int isdir );
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
 
@@ -16,19 +22,65 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	char arg3[1024];
+	int inumber, args, opt;
+	int mounted = 0;
+	int64_t result;
+	int cacheblocks = CACHE_DEFAULT_BLOCKS;
+	int backend = DISK_BACKEND_PREAD;
+	const char *statsfile = 0;
+	const char *tracefile = 0;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	while((opt=getopt(argc,argv,"c:g:mp:r:s:t:"))!=-1) {
+		switch(opt) {
+		case 'c':
+			cacheblocks = atoi(optarg);
+			break;
+		case 'g':
+			fs_set_commit_interval(atoi(optarg));
+			break;
+		case 'p':
+			fs_set_prealloc(atoi(optarg));
+			break;
+		case 'r':
+			fs_set_readahead(atoi(optarg));
+			break;
+		case 'm':
+			backend = DISK_BACKEND_MMAP;
+			break;
+		case 's':
+			statsfile = optarg;
+			break;
+		case 't':
+			tracefile = optarg;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-m] [-c cacheblocks] [-g commitinterval] [-p preallocblocks] [-r readaheadblocks] [-s statsfile] [-t tracefile] <diskfile> <nblocks>\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+	if(!disk_init(argv[optind],atoi(argv[optind+1]),backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	if(tracefile && !disk_trace(tracefile)) {
+		printf("couldn't create trace %s: %s\n",tracefile,strerror(errno));
+		return 1;
+	}
+
+	if(!cache_init(cacheblocks)) {
+		printf("couldn't allocate a cache of %d blocks\n",cacheblocks);
+		return 1;
+	}
+
+	printf("opened emulated disk image %s with %d blocks\n",argv[optind],disk_size());
 
 	while(1) {
 		printf(" simplefs> ");
@@ -39,22 +91,24 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
+			int flags = format_flags(strstr(line,cmd)+strlen(cmd));
+			if(flags>=0) {
+				if(fs_format(flags)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [extents] [journal] [inline]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
 				if(fs_mount()) {
+					mounted = 1;
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
@@ -62,38 +116,84 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					mounted = 0;
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync()) {
+					printf("disk synced.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else {
+				printf("use: sync\n");
+			}
+		} else if(!strcmp(cmd,"check")) {
+			if(args==1) {
+				if(fs_check()) {
+					printf("filesystem is consistent.\n");
+				} else {
+					printf("check found problems!\n");
+				}
+			} else {
+				printf("use: check\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
 			} else {
 				printf("use: debug\n");
 			}
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				stats_print();
+			} else if(args==2 && !strcmp(arg1,"reset")) {
+				stats_reset();
+				printf("stats reset.\n");
+			} else {
+				printf("use: stats [reset]\n");
+			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = resolve(arg1);
 				result = fs_getsize(inumber);
 				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
+					printf("inode %d has size %lld\n",inumber,(long long)result);
 				} else {
 					printf("getsize failed!\n");
 				}
 			} else {
-				printf("use: getsize <inumber>\n");
+				printf("use: getsize <inumber|path>\n");
 			}
 			
 		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
+			if(args<=2) {
+				inumber = args==2 ? fs_create_path(arg1) : fs_create();
 				if(inumber>0) {
 					printf("created inode %d\n",inumber);
 				} else {
 					printf("create failed!\n");
 				}
 			} else {
-				printf("use: create\n");
+				printf("use: create [path]\n");
 			}
 		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
+			if(args==2 && arg1[0]=='/') {
+				if(fs_unlink(arg1)) {
+					printf("%s deleted.\n",arg1);
+				} else {
+					printf("delete failed!\n");
+				}
+			} else if(args==2) {
 				inumber = atoi(arg1);
 				if(fs_delete(inumber)) {
 					printf("inode %d deleted.\n",inumber);
@@ -101,52 +201,122 @@ int main( int argc, char *argv[] )
 					printf("delete failed!\n");	
 				}
 			} else {
-				printf("use: delete <inumber>\n");
+				printf("use: delete <inumber|path>\n");
+			}
+		} else if(!strcmp(cmd,"truncate")) {
+			if(args==3) {
+				if(fs_truncate(resolve(arg1),atoll(arg2))) {
+					printf("%s truncated to %lld bytes\n",arg1,atoll(arg2));
+				} else {
+					printf("truncate failed!\n");
+				}
+			} else {
+				printf("use: truncate <inumber|path> <size>\n");
+			}
+		} else if(!strcmp(cmd,"punch")) {
+			if(args==4) {
+				if(fs_punch(resolve(arg1),atoll(arg2),atoll(arg3))) {
+					printf("punched %lld bytes at %lld in %s\n",atoll(arg3),atoll(arg2),arg1);
+				} else {
+					printf("punch failed!\n");
+				}
+			} else {
+				printf("use: punch <inumber|path> <offset> <length>\n");
+			}
+		} else if(!strcmp(cmd,"compress")) {
+			if(args==2 || (args==3 && (!strcmp(arg2,"on") || !strcmp(arg2,"off")))) {
+				int on = (args==2 || !strcmp(arg2,"on"));
+				if(fs_set_compression(resolve(arg1),on)) {
+					printf("compression %s for %s\n",on ? "on" : "off",arg1);
+				} else {
+					printf("compress failed!\n");
+				}
+			} else {
+				printf("use: compress <inumber|path> [on|off]\n");
+			}
+		} else if(!strcmp(cmd,"mkdir")) {
+			if(args==2) {
+				if(fs_mkdir(arg1)) {
+					printf("created directory %s\n",arg1);
+				} else {
+					printf("mkdir failed!\n");
+				}
+			} else {
+				printf("use: mkdir <path>\n");
+			}
+		} else if(!strcmp(cmd,"rmdir")) {
+			if(args==2) {
+				if(fs_rmdir(arg1)) {
+					printf("%s removed.\n",arg1);
+				} else {
+					printf("rmdir failed!\n");
+				}
+			} else {
+				printf("use: rmdir <path>\n");
+			}
+		} else if(!strcmp(cmd,"ls")) {
+			if(args<=2) {
+				if(fs_readdir(args==2 ? arg1 : "/",do_ls,0)<0) {
+					printf("ls failed!\n");
+				}
+			} else {
+				printf("use: ls [path]\n");
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = resolve(arg1);
 				if(!do_copyout(inumber,"/dev/stdout")) {
 					printf("cat failed!\n");
 				}
 			} else {
-				printf("use: cat <inumber>\n");
+				printf("use: cat <inumber|path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
+				inumber = resolve(arg2);
+				if(inumber<0) inumber = fs_create_path(arg2);
+				if(inumber>0 && do_copyin(arg1,inumber)) {
 					printf("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				printf("use: copyin <filename> <inumber|path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyout")) {
 			if(args==3) {
-				inumber = atoi(arg1);
+				inumber = resolve(arg1);
 				if(do_copyout(inumber,arg2)) {
 					printf("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
+				printf("use: copyout <inumber|path> <filename>\n");
 			}
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [extents] [journal] [inline]\n");
 			printf("    mount\n");
+			printf("    unmount\n");
+			printf("    sync\n");
+			printf("    check\n");
 			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
+			printf("    stats   [reset]\n");
+			printf("    create  [path]\n");
+			printf("    delete  <inode|path>\n");
+			printf("    truncate <inode|path> <size>\n");
+			printf("    punch   <inode|path> <offset> <length>\n");
+			printf("    compress <inode|path> [on|off]\n");
+			printf("    mkdir   <path>\n");
+			printf("    rmdir   <path>\n");
+			printf("    ls      [path]\n");
+			printf("    cat     <inode|path>\n");
+			printf("    copyin  <file> <inode|path>\n");
+			printf("    copyout <inode|path> <file>\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -162,15 +332,52 @@ int main( int argc, char *argv[] )
 	}
 
 	printf("closing emulated disk.\n");
+	if(mounted) fs_unmount();
+	cache_close();
 	disk_close();
 
+	if(statsfile && !stats_dump(statsfile)) {
+		printf("couldn't write %s: %s\n",statsfile,strerror(errno));
+	}
+
 	return 0;
 }
 
+// Turn the words after format into FS_FORMAT_* flags, each allowed once.
+// Returns -1 for anything else.
+static int format_flags( char *options )
+{
+	static const char *names[] = { "extents", "journal", "inline" };
+	static const int values[] = { FS_FORMAT_EXTENTS, FS_FORMAT_JOURNAL, FS_FORMAT_INLINE };
+	int flags = 0;
+	char *word;
+	int i;
+
+	for(word=strtok(options," \t"); word; word=strtok(0," \t")) {
+		for(i=0; i<3 && strcmp(word,names[i]); i++);
+		if(i==3 || (flags & values[i])) return -1;
+		flags |= values[i];
+	}
+	return flags;
+}
+
+// Arguments starting with / are paths, anything else an inode number.
+// Returns -1 for a path that doesn't exist.
+static int resolve( const char *arg )
+{
+	return arg[0]=='/' ? fs_lookup(arg) : atoi(arg);
+}
+
+static void do_ls( void *arg, const char *name, int inumber, int isdir )
+{
+	printf("%8d %s%s\n",inumber,name,isdir ? "/" : "");
+}
+
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	int64_t offset=0;
+	int result, actual;
 	char buffer[16384];
 
 	file = fopen(filename,"r");
@@ -196,7 +403,7 @@ static int do_copyin( const char *filename, int inumber )
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%lld bytes copied\n",(long long)offset);
 
 	fclose(file);
 	return 1;
@@ -205,7 +412,8 @@ static int do_copyin( const char *filename, int inumber )
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
+	int64_t offset=0;
+	int result;
 	char buffer[16384];
 
 	file = fopen(filename,"w");
@@ -221,7 +429,7 @@ static int do_copyout( int inumber, const char *filename )
 		offset += result;
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%lld bytes copied\n",(long long)offset);
 
 	fclose(file);
 	return 1;
@@ -0,0 +1,127 @@
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Every field is updated with atomic adds, so any thread may record a call
+// without a lock. A reset that races with a call may lose that one call.
+struct op_stats {
+	int64_t calls;
+	int64_t bytes;
+	int64_t totalns;
+	int64_t maxns;
+	int64_t buckets[STATS_BUCKETS];
+};
+
+static struct op_stats stats[STATS_OPS];
+
+static const char *opNames[STATS_OPS] = {
+	"disk_read", "disk_write",
+	"fs_format", "fs_mount", "fs_unmount", "fs_check", "fs_debug",
+	"fs_create", "fs_delete", "fs_getsize", "fs_read", "fs_write", "fs_sync",
+	"fs_truncate", "fs_punch", "fs_set_compression",
+	"fs_lookup", "fs_mkdir", "fs_rmdir", "fs_unlink", "fs_readdir"
+};
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of( int64_t ns )
+{
+	int b = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS-1;
+}
+
+// Upper bound, in microseconds, of the bucket that holds the p'th fraction
+// of the calls.
+static double percentile( struct op_stats *s, double p )
+{
+	int64_t want = p * s->calls;
+	int64_t seen = 0;
+	int i;
+
+	for(i=0;i<STATS_BUCKETS;i++) {
+		seen += s->buckets[i];
+		if(seen > want) break;
+	}
+	if(i >= STATS_BUCKETS) i = STATS_BUCKETS-1;
+	return (double)((int64_t)2<<i) / 1000;
+}
+
+int64_t stats_start()
+{
+	return now_ns();
+}
+
+void stats_record( int op, int64_t start, int64_t bytes )
+{
+	struct op_stats *s = &stats[op];
+	int64_t ns = now_ns() - start;
+	int64_t max;
+
+	__sync_fetch_and_add(&s->calls,1);
+	__sync_fetch_and_add(&s->bytes,bytes);
+	__sync_fetch_and_add(&s->totalns,ns);
+	__sync_fetch_and_add(&s->buckets[bucket_of(ns)],1);
+
+	max = __atomic_load_n(&s->maxns,__ATOMIC_RELAXED);
+	while(ns > max && !__sync_bool_compare_and_swap(&s->maxns,max,ns))
+		max = __atomic_load_n(&s->maxns,__ATOMIC_RELAXED);
+}
+
+void stats_reset()
+{
+	memset(stats,0,sizeof(stats));
+}
+
+void stats_print()
+{
+	int op, i;
+
+	printf("%-11s %10s %14s %10s %10s %10s %10s\n","op","calls","bytes","mean us","p50 us","p99 us","max us");
+	for(op=0;op<STATS_OPS;op++) {
+		struct op_stats *s = &stats[op];
+		if(!s->calls) continue;
+		printf("%-11s %10lld %14lld %10.2f %10.2f %10.2f %10.2f\n",opNames[op],
+			(long long)s->calls,(long long)s->bytes,(double)s->totalns/s->calls/1000,
+			percentile(s,0.50),percentile(s,0.99),(double)s->maxns/1000);
+	}
+
+	for(op=0;op<STATS_OPS;op++) {
+		struct op_stats *s = &stats[op];
+		if(!s->calls) continue;
+		printf("%s latency histogram:\n",opNames[op]);
+		for(i=0;i<STATS_BUCKETS;i++) {
+			if(s->buckets[i])
+				printf("\t< %12.3f us: %lld\n",(double)((int64_t)2<<i)/1000,(long long)s->buckets[i]);
+		}
+	}
+}
+
+// Write every counter and histogram to filename as one JSON object.
+int stats_dump( const char *filename )
+{
+	FILE *file = fopen(filename,"w");
+	int op, i;
+
+	if(!file) return 0;
+
+	fprintf(file,"{\n");
+	for(op=0;op<STATS_OPS;op++) {
+		struct op_stats *s = &stats[op];
+		fprintf(file,"  \"%s\": {\"calls\": %lld, \"bytes\": %lld, \"total_ns\": %lld, \"max_ns\": %lld, \"buckets_ns\": [",
+			opNames[op],(long long)s->calls,(long long)s->bytes,(long long)s->totalns,(long long)s->maxns);
+		for(i=0;i<STATS_BUCKETS;i++)
+			fprintf(file,"%s%lld",i ? ", " : "",(long long)s->buckets[i]);
+		fprintf(file,"]}%s\n",op<STATS_OPS-1 ? "," : "");
+	}
+	fprintf(file,"}\n");
+
+	return fclose(file)==0;
+}
@@ -0,0 +1,41 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Latencies are counted in log-scale buckets: bucket i holds the calls that
+// took less than 2^(i+1) nanoseconds and at least 2^i (bucket 0 from zero).
+#define STATS_BUCKETS 40
+
+enum stats_op {
+	STATS_DISK_READ,
+	STATS_DISK_WRITE,
+	STATS_FS_FORMAT,
+	STATS_FS_MOUNT,
+	STATS_FS_UNMOUNT,
+	STATS_FS_CHECK,
+	STATS_FS_DEBUG,
+	STATS_FS_CREATE,
+	STATS_FS_DELETE,
+	STATS_FS_GETSIZE,
+	STATS_FS_READ,
+	STATS_FS_WRITE,
+	STATS_FS_SYNC,
+	STATS_FS_TRUNCATE,
+	STATS_FS_PUNCH,
+	STATS_FS_COMPRESS,
+	STATS_FS_LOOKUP,
+	STATS_FS_MKDIR,
+	STATS_FS_RMDIR,
+	STATS_FS_UNLINK,
+	STATS_FS_READDIR,
+	STATS_OPS
+};
+
+int64_t stats_start();
+void stats_record( int op, int64_t start, int64_t bytes );
+void stats_reset();
+void stats_print();
+int  stats_dump( const char *filename );
+
+#endif